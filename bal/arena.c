@@ -0,0 +1,97 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <bal/arena.h>
+#include <gd_bal.h>
+#include <string.h>
+
+/* Arenas grow by at least this many pages at a time */
+#define ARENA_CHUNK_PAGES 16
+
+/* Each chunk starts with one of these */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t              pages;
+};
+
+/*! Adds a chunk big enough for \p size bytes aligned to \p align to \p arena,
+ *  and returns the allocation
+ */
+static void *arena_grow(struct arena *arena, size_t size, size_t align)
+{
+    size_t need  = sizeof (struct arena_chunk) + align - 1 + size;
+    size_t pages = ARENA_CHUNK_PAGES;
+    void *p;
+
+    if (need < size)
+        return NULL;
+    if (need > pages * 4096)
+        pages = need / 4096 + 1;
+
+    if (gd_alloc_pages(gd_boot_services_data, &p, pages))
+        return NULL;
+
+    struct arena_chunk *chunk = p;
+    chunk->pages = pages;
+    chunk->next  = arena->chunks;
+    arena->chunks = chunk;
+
+    uintptr_t start = ((uintptr_t) &chunk[1] + align - 1) & ~(uintptr_t) (align - 1);
+    uintptr_t end   = (uintptr_t) p + pages * 4096;
+
+    /* Only carry on bumping from the new chunk if it has more room left than
+     * the one we were using; an outsized allocation shouldn't waste the rest
+     * of that.
+     */
+    if (end - (start + size) > arena->end - arena->next) {
+        arena->next = start + size;
+        arena->end  = end;
+    }
+
+    return (void*) start;
+}
+
+void *arena_alloc(struct arena *arena, size_t size, size_t align)
+{
+    uintptr_t start = (arena->next + align - 1) & ~(uintptr_t) (align - 1);
+
+    if (!arena->next || start < arena->next || start > arena->end
+            || arena->end - start < size)
+        return arena_grow(arena, size, align);
+
+    arena->next = start + size;
+    return (void*) start;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len, 1);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next;
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        gd_free_pages(chunk, chunk->pages);
+    }
+
+    arena->chunks = NULL;
+    arena->next   = arena->end = 0;
+}
@@ -17,9 +17,92 @@
 #include <bal/misc.h>
 #include <libfdt.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
+/*! Translates the \p size bytes at \p addr on the bus of node \p bus to a
+ *  CPU physical address by walking the ranges of it and every node above,
+ *  for buses which don't have a simple-bus bound to them. A node without
+ *  ranges passes addresses through unchanged, as we always used to.
+ */
+static bool sb_translate_node(
+    dt_node_t bus,
+    uint64_t addr,
+    uint64_t size,
+    uint64_t *cpu_addr)
+{
+    for (; bus->parent; bus = bus->parent) {
+        dt_property_t prop = dt_node_find_property_atom(bus, &dt_atom_ranges);
+        if (!prop || !prop->value_len)
+            continue;
+
+        unsigned addr_cells   = dt_node_get_address_cells(bus);
+        unsigned size_cells   = dt_node_get_size_cells(bus);
+        unsigned parent_cells = dt_node_get_address_cells(bus->parent);
+        unsigned cells = addr_cells + parent_cells + size_cells;
+        unsigned count = cells ? prop->value_len / (cells * sizeof(uint32_t))
+                               : 0;
+
+        const uint32_t *p = prop->value;
+        unsigned i;
+        for (i = 0; i < count; i++, p += cells) {
+            uint64_t bus_addr = dt_read_cells(p, addr_cells);
+            uint64_t len = dt_read_cells(p + addr_cells + parent_cells,
+                                         size_cells);
+            if (addr >= bus_addr && addr - bus_addr < len
+                    && size <= len - (addr - bus_addr)) {
+                addr = dt_read_cells(p + addr_cells, parent_cells)
+                     + (addr - bus_addr);
+                break;
+            }
+        }
+        if (i == count)
+            return false;
+    }
+
+    *cpu_addr = addr;
+    return true;
+}
+
+/*! Translates the \p size bytes at \p addr on the bus to a CPU physical
+ *  address, returning false if they aren't all inside one window
+ */
+static bool sb_translate(
+    const struct simple_bus_dev *self,
+    uint64_t addr,
+    uint64_t size,
+    uint64_t *cpu_addr)
+{
+    if (self->through_parent)
+        return sb_translate_node(self->node->parent, addr, size, cpu_addr);
+
+    if (self->identity) {
+        *cpu_addr = addr;
+        return true;
+    }
+
+    /* Find the last window starting at or below addr */
+    unsigned lo = 0, hi = self->range_count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (self->ranges[mid].bus_addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return false;
+
+    const struct simple_bus_range *range = &self->ranges[lo - 1];
+    uint64_t offset = addr - range->bus_addr;
+    if (offset >= range->size || size > range->size - offset)
+        return false;
+
+    *cpu_addr = range->cpu_addr + offset;
+    return true;
+}
+
 static int sb_bus_get_child_reg_addr(
     struct simple_bus_dev* self,
     gd_device_t child,
@@ -33,17 +116,19 @@ static int sb_bus_get_child_reg_addr(
     if ((rv = gd_device_get_dt_node(child, &node)))
         return rv;
 
-    uintptr_t base_addr;
-    size_t base_size;
-
-    if (dt_node_get_reg_range(node, idx, &base_addr, &base_size)) {
-        *addr = GIO_MMIO_ADDR(base_addr);
-        *len  = base_size;
+    unsigned count;
+    const struct dt_reg *regs = dt_node_get_regs(node, &count);
+    if (idx >= count)
+        return ERANGE;
 
-        return 0;
-    } else {
+    uint64_t cpu_addr;
+    if (!sb_translate(self, regs[idx].addr, regs[idx].size, &cpu_addr)
+            || cpu_addr > UINTPTR_MAX || regs[idx].size > SIZE_MAX)
         return ERANGE;
-    }
+
+    *addr = GIO_MMIO_ADDR((uintptr_t) cpu_addr);
+    *len  = regs[idx].size;
+    return 0;
 }
 
 static int sb_bus_get_child_reg_count(
@@ -56,7 +141,7 @@ static int sb_bus_get_child_reg_count(
     if ((rv = gd_device_get_dt_node(child, &node)))
         return rv;
 
-    *count = dt_node_get_reg_count(node);
+    dt_node_get_regs(node, count);
     return 0;
 }
 
@@ -66,14 +151,105 @@ static GD_BEGIN_IOCTL_MAP(struct simple_bus_dev *, simple_bus_ioctl)
     GD_MAP_BUS_GET_CHILD_REG_ADDR_IOCTL(sb_bus_get_child_reg_addr)
 GD_END_IOCTL_MAP_FORWARD_BASE(dt_base_ioctl)
 
+static int sb_range_cmp(const void *l_, const void *r_)
+{
+    const struct simple_bus_range *l = l_, *r = r_;
+    return l->bus_addr < r->bus_addr ? -1 : l->bus_addr > r->bus_addr;
+}
+
+/*! Builds the translation table of \p self from its ranges property. Each
+ *  window is translated through the bus above, which is bound before us, so
+ *  resolving a register is one lookup however deeply buses nest. A parent
+ *  which isn't a simple-bus, such as a simple-mfd or a node no driver binds
+ *  to, is translated through by walking the ranges of the nodes above.
+ */
+static bool sb_build_ranges(
+    struct simple_bus_dev *self,
+    unsigned addr_cells,
+    unsigned size_cells)
+{
+    dt_node_t node = self->node;
+
+    /* The simple-bus above, or NULL if there is none and addresses there
+     * are translated by sb_translate_node
+     */
+    struct simple_bus_dev *parent = NULL;
+    if (node->parent && node->parent->parent) {
+        gd_device_t dev = dt_probe_node(node->parent);
+        if (dev && dev->ioctl == simple_bus_ioctl)
+            parent = (struct simple_bus_dev *) dev;
+    }
+
+    dt_property_t prop = dt_node_find_property_atom(node, &dt_atom_ranges);
+    if (!prop) {
+        /* Nothing on the bus is memory mapped */
+        return true;
+    }
+
+    if (!prop->value_len) {
+        /* Addresses pass through unchanged */
+        if (!parent) {
+            self->identity       = !node->parent || !node->parent->parent;
+            self->through_parent = !self->identity;
+        } else {
+            self->identity    = parent->identity;
+            self->ranges      = parent->ranges;
+            self->range_count = parent->range_count;
+        }
+        return true;
+    }
+
+    unsigned parent_cells = dt_node_get_address_cells(node->parent);
+    unsigned cells = addr_cells + parent_cells + size_cells;
+    if (prop->value_len % (cells * sizeof(uint32_t)) != 0) {
+        panic("simple-bus \"%s\": <ranges> has size %zu which isn't "
+            "divisible by %u cells\n", node->path, prop->value_len, cells);
+    }
+
+    unsigned count = prop->value_len / (cells * sizeof(uint32_t));
+    self->ranges = malloc(count * sizeof *self->ranges);
+    if (!self->ranges)
+        return false;
+
+    const uint32_t *p = prop->value;
+    for (unsigned i = 0; i < count; i++, p += cells) {
+        struct simple_bus_range *range = &self->ranges[self->range_count];
+        range->bus_addr = dt_read_cells(p, addr_cells);
+        range->size     = dt_read_cells(p + addr_cells + parent_cells,
+                                        size_cells);
+
+        uint64_t parent_addr = dt_read_cells(p + addr_cells, parent_cells);
+        bool mapped = parent
+            ? sb_translate(parent, parent_addr, range->size, &range->cpu_addr)
+            : sb_translate_node(node->parent, parent_addr, range->size,
+                                &range->cpu_addr);
+        if (!mapped) {
+            printf("simple-bus \"%s\": range %u isn't mapped by the parent "
+                "bus\n", node->path, i);
+            continue;
+        }
+
+        if (range->size)
+            self->range_count++;
+    }
+
+    qsort(self->ranges, self->range_count, sizeof *self->ranges,
+          sb_range_cmp);
+    return true;
+}
+
 static gd_device_t sb_driver_attach(
     dt_node_t node)
 {
     struct simple_bus_dev *self = malloc(sizeof *self);
     if (!self)
         return NULL;
-    self->ioctl = simple_bus_ioctl;
-    self->node  = node;
+    self->ioctl          = simple_bus_ioctl;
+    self->node           = node;
+    self->identity       = false;
+    self->ranges         = NULL;
+    self->range_count    = 0;
+    self->through_parent = false;
 
     unsigned addr_cells = dt_node_get_address_cells(node);
     unsigned size_cells = dt_node_get_size_cells(node);
@@ -96,6 +272,11 @@ static gd_device_t sb_driver_attach(
             path, size_cells);
     }
 
+    if (!sb_build_ranges(self, addr_cells, size_cells)) {
+        free(self);
+        return NULL;
+    }
+
     return &self->dev;
 }
 
@@ -48,20 +48,8 @@ static int dt_device_get_path(
     if ((rv = gd_device_get_dt_node(dev, &node)))
         return rv;
 
-    if (node->parent) {
-        gd_device_t parent = node->parent->bound_device;
-        if (!parent) {
-            return ENOENT;
-        }
-
-        if ((rv = gd_device_get_path(parent, buf, szBuf, szNeeded)))
-            return rv;
-    } else {
-        *szNeeded = strlcpy(buf, "/", szBuf);
-    }
-
-    *szNeeded += strlen(node->name);
-    strlcat(buf, node->name, szBuf);
+    *szNeeded = node->path_len;
+    strlcpy(buf, node->path, szBuf);
 
     return 0;
 }
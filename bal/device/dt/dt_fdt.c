@@ -0,0 +1,351 @@
+#include <bal/device/dt.h>
+#include <bal/misc.h>
+#include <bal/arena.h>
+#include <libfdt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Scratch space for laying the blob out, released once it has been written */
+static struct arena fdt_arena = ARENA_INITIALIZER;
+
+#define FDT_PAD(len) (((len) + 3) & ~(size_t) 3)
+
+/* Where each property name goes in the strings block. Names are interned,
+ * so they are told apart by pointer.
+ */
+struct name_slot {
+    struct dt_hash_slot h;
+    uint32_t            offset;
+};
+
+/* The layout worked out by dt_fdt_size. It holds until the tree changes. */
+static struct {
+    bool                 valid;
+    uint32_t             changes;
+
+    size_t               rsv_size;
+    size_t               struct_size;
+    /*! Size of the structure block of system_fdt, when patching it */
+    size_t               old_struct_size;
+    size_t               strings_size;
+
+    struct dt_hash_table names;
+
+    /*! Only /chosen differs from system_fdt, so the blob is copied with new
+     *  properties for it spliced in between \p props_start and \p props_end
+     */
+    bool                 patch;
+    dt_node_t            chosen;
+    int                  props_start;
+    int                  props_end;
+} layout;
+
+static struct name_slot *name_slot(const char *name, uint32_t hash)
+{
+    return dt_hash_find(&layout.names, name, hash);
+}
+
+/*! Returns the offset of an existing copy of \p name in the strings block
+ *  of system_fdt, or -1
+ */
+static int fdt_name_offset(const char *name)
+{
+    const char *strings = (const char *) system_fdt
+                        + fdt_off_dt_strings(system_fdt);
+    uint32_t size = fdt_size_dt_strings(system_fdt);
+
+    if (name >= strings && name < strings + size)
+        return name - strings;
+
+    size_t len = strlen(name) + 1;
+    for (uint32_t off = 0; off + len <= size;
+             off += strnlen(strings + off, size - off) + 1) {
+        if (!memcmp(strings + off, name, len))
+            return off;
+    }
+    return -1;
+}
+
+/*! Gives \p name a place in the strings block, if it doesn't have one */
+static void layout_name(const char *name, uint32_t hash)
+{
+    struct name_slot *slot = dt_hash_insert(&layout.names, name, hash);
+    if (!slot)
+        panic("Out of memory laying out the FDT");
+    if (slot->h.key)
+        return;
+
+    int offset = layout.patch ? fdt_name_offset(name) : -1;
+
+    slot->h.key  = name;
+    slot->h.hash = hash;
+    if (offset >= 0) {
+        slot->offset = offset;
+    } else {
+        slot->offset = layout.strings_size;
+        layout.strings_size += strlen(name) + 1;
+    }
+}
+
+/*! Adds the properties of \p node to the layout, returning their size in the
+ *  structure block
+ */
+static size_t layout_properties(dt_node_t node)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < dt_node_property_count(node); i++) {
+        const struct dt_slot *slot = &node->properties.slots[i];
+        dt_property_t prop = slot->item;
+
+        layout_name(slot->name, slot->hash);
+        size += sizeof (struct fdt_property) + FDT_PAD(prop->value_len);
+    }
+    return size;
+}
+
+static size_t layout_node(dt_node_t node)
+{
+    size_t size = 2 * FDT_TAGSIZE + FDT_PAD(strlen(node->name) + 1)
+                + layout_properties(node);
+
+    for (size_t i = 0; i < dt_node_child_count(node); i++)
+        size += layout_node(dt_node_child(node, i));
+    return size;
+}
+
+/*! Returns the size of the structure block of system_fdt. Headers before
+ *  version 17 don't give it, so for those it is found by walking to FDT_END.
+ */
+static size_t fdt_struct_size(void)
+{
+    if (fdt_version(system_fdt) >= 17)
+        return fdt_size_dt_struct(system_fdt);
+
+    int next;
+    for (int offset = 0;; offset = next) {
+        uint32_t tag = fdt_next_tag(system_fdt, offset, &next);
+        if (next < 0)
+            panic("dt: bad FDT structure: %s", fdt_strerror(next));
+        if (tag == FDT_END)
+            return next;
+    }
+}
+
+/*! Whether everything which changed is in /chosen, as when only the command
+ *  line and initrd have been filled in
+ */
+static bool only_chosen_changed(void)
+{
+    if (!system_fdt)
+        return false;
+
+    layout.chosen = NULL;
+    for (dt_node_t node = dt_dirty_nodes; node; node = node->dirty_next) {
+        if (node->fdt_offset < 0 || strcmp(node->path, "/chosen"))
+            return false;
+        layout.chosen = node;
+    }
+    return true;
+}
+
+static void layout_fdt(void)
+{
+    arena_release(&fdt_arena);
+    memset(&layout, 0, sizeof layout);
+    layout.names = (struct dt_hash_table)
+        DT_HASH_TABLE_INITIALIZER(struct name_slot, &fdt_arena, NULL);
+    layout.changes = dt_change_count;
+
+    int num_rsv = system_fdt ? fdt_num_mem_rsv(system_fdt) : 0;
+    layout.rsv_size = (num_rsv + 1) * sizeof (struct fdt_reserve_entry);
+
+    layout.patch = only_chosen_changed();
+    if (layout.patch) {
+        layout.old_struct_size = fdt_struct_size();
+        layout.struct_size     = layout.old_struct_size;
+        layout.strings_size    = fdt_size_dt_strings(system_fdt);
+
+        if (layout.chosen) {
+            /* Find the old properties; any children follow them */
+            int next, offset = layout.chosen->fdt_offset;
+            fdt_next_tag(system_fdt, offset, &layout.props_start);
+
+            offset = layout.props_start;
+            for (;;) {
+                uint32_t tag = fdt_next_tag(system_fdt, offset, &next);
+                if (tag != FDT_PROP && tag != FDT_NOP)
+                    break;
+                offset = next;
+            }
+            layout.props_end = offset;
+
+            layout.struct_size -= layout.props_end - layout.props_start;
+            layout.struct_size += layout_properties(layout.chosen);
+        }
+    } else {
+        dt_node_t root = dt_root_node();
+        if (!root)
+            panic("No device tree to write out");
+
+        layout.struct_size = layout_node(root) + FDT_TAGSIZE;
+    }
+
+    layout.valid = true;
+}
+
+size_t dt_fdt_size(void)
+{
+    if (!layout.valid || layout.changes != dt_change_count)
+        layout_fdt();
+
+    return sizeof (struct fdt_header) + layout.rsv_size
+         + layout.struct_size + layout.strings_size;
+}
+
+static char *emit_u32(char *p, uint32_t v)
+{
+    fdt32_t cell = cpu_to_fdt32(v);
+    memcpy(p, &cell, sizeof cell);
+    return p + sizeof cell;
+}
+
+static char *emit_padded(char *p, const void *data, size_t len)
+{
+    memcpy(p, data, len);
+    memset(p + len, 0, FDT_PAD(len) - len);
+    return p + FDT_PAD(len);
+}
+
+static char *emit_properties(char *p, dt_node_t node)
+{
+    size_t count = node->properties.count;
+    if (!count)
+        return p;
+
+    /* Properties are kept by name hash; they go out in the order they came
+     * in, which is the FDT's own for those which came from there
+     */
+    const struct dt_slot **slots = arena_alloc(&fdt_arena,
+        count * sizeof *slots, _Alignof(const struct dt_slot *));
+    if (!slots)
+        panic("Out of memory writing out the FDT");
+
+    for (size_t i = 0; i < count; i++) {
+        const struct dt_slot *slot = &node->properties.slots[i];
+        slots[((dt_property_t) slot->item)->order] = slot;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct dt_slot *slot = slots[i];
+        dt_property_t prop = slot->item;
+
+        p = emit_u32(p, FDT_PROP);
+        p = emit_u32(p, prop->value_len);
+        p = emit_u32(p, name_slot(slot->name, slot->hash)->offset);
+        p = emit_padded(p, prop->value, prop->value_len);
+    }
+    return p;
+}
+
+/*! Orders nodes as they were in system_fdt, followed by those added since */
+static int compare_fdt_offset(const void *a, const void *b)
+{
+    unsigned x = (*(const dt_node_t *) a)->fdt_offset;
+    unsigned y = (*(const dt_node_t *) b)->fdt_offset;
+    return x < y ? -1 : x > y;
+}
+
+static char *emit_node(char *p, dt_node_t node)
+{
+    p = emit_u32(p, FDT_BEGIN_NODE);
+    p = emit_padded(p, node->name, strlen(node->name) + 1);
+    p = emit_properties(p, node);
+
+    size_t count = node->children.count;
+    if (count) {
+        /* Children are kept by name hash; some things care about order */
+        dt_node_t *children = arena_alloc(&fdt_arena, count * sizeof *children,
+                                          _Alignof(dt_node_t));
+        if (!children)
+            panic("Out of memory writing out the FDT");
+
+        for (size_t i = 0; i < count; i++)
+            children[i] = node->children.slots[i].item;
+        qsort(children, count, sizeof *children, compare_fdt_offset);
+
+        for (size_t i = 0; i < count; i++)
+            p = emit_node(p, children[i]);
+    }
+
+    return emit_u32(p, FDT_END_NODE);
+}
+
+int dt_fdt_write(void *buf, size_t size)
+{
+    size_t total = dt_fdt_size();
+    if (size < total)
+        return ENOSPC;
+
+    char *out = buf;
+    size_t off_rsv     = sizeof (struct fdt_header);
+    size_t off_struct  = off_rsv + layout.rsv_size;
+    size_t off_strings = off_struct + layout.struct_size;
+
+    struct fdt_header hdr = {
+        .magic             = cpu_to_fdt32(FDT_MAGIC),
+        .totalsize         = cpu_to_fdt32(total),
+        .off_dt_struct     = cpu_to_fdt32(off_struct),
+        .off_dt_strings    = cpu_to_fdt32(off_strings),
+        .off_mem_rsvmap    = cpu_to_fdt32(off_rsv),
+        .version           = cpu_to_fdt32(17),
+        .last_comp_version = cpu_to_fdt32(16),
+        .boot_cpuid_phys   = cpu_to_fdt32(system_fdt
+                                ? fdt_boot_cpuid_phys(system_fdt) : 0),
+        .size_dt_strings   = cpu_to_fdt32(layout.strings_size),
+        .size_dt_struct    = cpu_to_fdt32(layout.struct_size),
+    };
+    memcpy(out, &hdr, sizeof hdr);
+
+    /* Memory reservations, which end with an empty one */
+    memset(out + off_rsv, 0, layout.rsv_size);
+    if (system_fdt) {
+        memcpy(out + off_rsv,
+               (const char *) system_fdt + fdt_off_mem_rsvmap(system_fdt),
+               layout.rsv_size - sizeof (struct fdt_reserve_entry));
+    }
+
+    char *p = out + off_struct;
+    if (layout.patch) {
+        const char *old = (const char *) system_fdt
+                        + fdt_off_dt_struct(system_fdt);
+        size_t old_size = layout.old_struct_size;
+
+        if (layout.chosen) {
+            memcpy(p, old, layout.props_start);
+            p = emit_properties(p + layout.props_start, layout.chosen);
+            memcpy(p, old + layout.props_end, old_size - layout.props_end);
+        } else {
+            memcpy(p, old, old_size);
+        }
+
+        memcpy(out + off_strings,
+               (const char *) system_fdt + fdt_off_dt_strings(system_fdt),
+               fdt_size_dt_strings(system_fdt));
+    } else {
+        p = emit_node(p, dt_root_node());
+        emit_u32(p, FDT_END);
+    }
+
+    for (uint32_t i = 0; i < layout.names.capacity; i++) {
+        const struct name_slot *slot = dt_hash_slot_at(&layout.names, i);
+        if (slot->h.key)
+            memcpy(out + off_strings + slot->offset, slot->h.key,
+                   strlen(slot->h.key) + 1);
+    }
+
+    /* The scratch space goes, and with it the layout */
+    arena_release(&fdt_arena);
+    layout.valid = false;
+    return 0;
+}
@@ -0,0 +1,395 @@
+#include <bal/device/dt.h>
+#include <bal/misc.h>
+#include <bal/arena.h>
+#include <libfdt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* The overlay is fixed up in a copy here, and merged in from there */
+static struct arena overlay_arena = ARENA_INITIALIZER;
+
+/* Deepest overlay nesting we apply */
+#define OVERLAY_MAX_DEPTH 32
+
+/*! Returns the cell at byte \p offset of property \p name of node \p node in
+ *  our copy of the overlay, or NULL if it isn't there
+ */
+static void *overlay_cell(void *fdto, int node, const char *name,
+                          size_t name_len, uint32_t offset)
+{
+    char buf[64];
+    if (name_len >= sizeof buf)
+        return NULL;
+    memcpy(buf, name, name_len);
+    buf[name_len] = 0;
+
+    int len;
+    const char *value = fdt_getprop(fdto, node, buf, &len);
+    if (!value || offset % sizeof (fdt32_t)
+            || offset + sizeof (fdt32_t) > (size_t) len)
+        return NULL;
+
+    /* It's our copy, so can be written */
+    return (void *) (value + offset);
+}
+
+static uint32_t cell_get(const void *cell)
+{
+    fdt32_t v;
+    memcpy(&v, cell, sizeof v);
+    return fdt32_to_cpu(v);
+}
+
+static void cell_set(void *cell, uint32_t val)
+{
+    fdt32_t v = cpu_to_fdt32(val);
+    memcpy(cell, &v, sizeof v);
+}
+
+/*! Moves the phandles the overlay defines above all of those in the tree */
+static void adjust_phandles(void *fdto, uint32_t delta)
+{
+    int depth = 0;
+    for (int node = fdt_next_node(fdto, -1, &depth); node >= 0;
+             node = fdt_next_node(fdto, node, &depth)) {
+        void *cell;
+        if ((cell = overlay_cell(fdto, node, "phandle", 7, 0)))
+            cell_set(cell, cell_get(cell) + delta);
+        if ((cell = overlay_cell(fdto, node, "linux,phandle", 13, 0)))
+            cell_set(cell, cell_get(cell) + delta);
+    }
+}
+
+/*! Moves the overlay's references to its own phandles to match. \p fixups is
+ *  a node of __local_fixups__ and \p node the node of the overlay it mirrors.
+ */
+static int adjust_local_fixups(void *fdto, int fixups, int node,
+                               uint32_t delta)
+{
+    for (int prop = fdt_first_property_offset(fdto, fixups); prop >= 0;
+             prop = fdt_next_property_offset(fdto, prop)) {
+        const char *name;
+        int len;
+        const char *offsets = fdt_getprop_by_offset(fdto, prop, &name, &len);
+
+        for (int i = 0; i + (int) sizeof (fdt32_t) <= len;
+                 i += sizeof (fdt32_t)) {
+            void *cell = overlay_cell(fdto, node, name, strlen(name),
+                                      cell_get(offsets + i));
+            if (!cell)
+                return EINVAL;
+            cell_set(cell, cell_get(cell) + delta);
+        }
+    }
+
+    for (int sub = fdt_first_subnode(fdto, fixups); sub >= 0;
+             sub = fdt_next_subnode(fdto, sub)) {
+        int child = fdt_subnode_offset(fdto, node,
+                                       fdt_get_name(fdto, sub, NULL));
+        if (child < 0)
+            return EINVAL;
+
+        int rv = adjust_local_fixups(fdto, sub, child, delta);
+        if (rv)
+            return rv;
+    }
+
+    return 0;
+}
+
+static uint32_t node_phandle(dt_node_t node)
+{
+    dt_property_t p = dt_node_find_property_atom(node, &dt_atom_phandle);
+    if (!p)
+        p = dt_node_find_property(node, "linux,phandle");
+
+    return p && p->value_len == sizeof (fdt32_t) ? dt_property_get_uint32(p)
+                                                 : 0;
+}
+
+/*! Fills in the overlay's references to labels in the tree. Each property
+ *  of __fixups__ is named for a label, and lists the "path:property:offset"
+ *  places it is used.
+ */
+static int resolve_fixups(void *fdto)
+{
+    int fixups = fdt_path_offset(fdto, "/__fixups__");
+    if (fixups < 0)
+        return 0;
+
+    dt_node_t symbols = dt_find_node_by_path("/__symbols__", 12);
+    if (!symbols)
+        return ENOENT;
+
+    for (int prop = fdt_first_property_offset(fdto, fixups); prop >= 0;
+             prop = fdt_next_property_offset(fdto, prop)) {
+        const char *label;
+        int len;
+        const char *uses = fdt_getprop_by_offset(fdto, prop, &label, &len);
+
+        dt_property_t sym = dt_node_find_property(symbols, label);
+        if (!sym) {
+            printf("dt: overlay refers to unknown label \"%s\"\n", label);
+            return ENOENT;
+        }
+
+        dt_node_t target = dt_find_node_by_path(sym->value,
+                               strnlen(sym->value, sym->value_len));
+        uint32_t phandle = target ? node_phandle(target) : 0;
+        if (!phandle)
+            return ENOENT;
+
+        for (int i = 0; i < len; i += strnlen(uses + i, len - i) + 1) {
+            const char *use  = uses + i;
+            const char *path_end = strchr(use, ':');
+            const char *prop_end = path_end ? strchr(path_end + 1, ':') : NULL;
+            if (!prop_end)
+                return EINVAL;
+
+            char path[256];
+            size_t path_len = path_end - use;
+            if (path_len >= sizeof path)
+                return EINVAL;
+            memcpy(path, use, path_len);
+            path[path_len] = 0;
+
+            int node = fdt_path_offset(fdto, path);
+            if (node < 0)
+                return EINVAL;
+
+            uint32_t offset = strtoul(prop_end + 1, NULL, 10);
+            void *cell = overlay_cell(fdto, node, path_end + 1,
+                                      prop_end - path_end - 1, offset);
+            if (!cell)
+                return EINVAL;
+            cell_set(cell, phandle);
+        }
+    }
+
+    return 0;
+}
+
+/*! Returns the node fragment \p fragment of the overlay applies to */
+static dt_node_t fragment_target(void *fdto, int fragment)
+{
+    int len;
+    const void *target = fdt_getprop(fdto, fragment, "target", &len);
+    if (target && len == sizeof (fdt32_t))
+        return dt_find_by_phandle(cell_get(target));
+
+    const char *path = fdt_getprop(fdto, fragment, "target-path", &len);
+    if (path && len > 0)
+        return dt_find_node_by_path(path, strnlen(path, len));
+
+    return NULL;
+}
+
+/*! Indexes what a newly merged node brings with it */
+static void index_node(dt_node_t node)
+{
+    uint32_t phandle = node_phandle(node);
+    if (phandle)
+        dt_index_phandle(phandle, node);
+
+    dt_property_t compat = dt_node_find_property_atom(node,
+                                                      &dt_atom_compatible);
+    if (!compat)
+        return;
+
+    /* Index the tree's own copy, which lives as long as the tree */
+    const char *list = compat->value;
+    for (size_t p = 0; p < compat->value_len;
+             p += strnlen(list + p, compat->value_len - p) + 1) {
+        bool listed = false;
+        for (const struct dt_node_list *l = dt_find_compatible(list + p);
+                 l && !listed; l = l->next)
+            listed = l->node == node;
+
+        if (!listed)
+            dt_index_compatible(list + p, node);
+    }
+}
+
+/*! Whether the nodes under \p node of the overlay are nested no deeper than
+ *  we apply
+ */
+static bool depth_ok(void *fdto, int node)
+{
+    int depth = 0;
+    for (int sub = fdt_next_node(fdto, node, &depth); sub >= 0 && depth > 0;
+             sub = fdt_next_node(fdto, sub, &depth)) {
+        if (depth >= OVERLAY_MAX_DEPTH)
+            return false;
+    }
+    return true;
+}
+
+/*! Merges overlay node \p src into \p node. Its depth has been checked, so
+ *  this can only fail for lack of memory.
+ */
+static int merge_node(dt_node_t node, void *fdto, int src)
+{
+    for (int prop = fdt_first_property_offset(fdto, src); prop >= 0;
+             prop = fdt_next_property_offset(fdto, prop)) {
+        const char *name;
+        int len;
+        const void *value = fdt_getprop_by_offset(fdto, prop, &name, &len);
+
+        if (!dt_node_set_property(node, name, value, len))
+            return ENOMEM;
+    }
+    index_node(node);
+
+    for (int sub = fdt_first_subnode(fdto, src); sub >= 0;
+             sub = fdt_next_subnode(fdto, sub)) {
+        const char *name = fdt_get_name(fdto, sub, NULL);
+        dt_node_t child = dt_node_find_child(node, name);
+        if (!child && !(child = dt_node_alloc(node, name)))
+            return ENOMEM;
+
+        int rv = merge_node(child, fdto, sub);
+        if (rv)
+            return rv;
+    }
+
+    return 0;
+}
+
+/*! Adds the overlay's labels to the tree's __symbols__. They name paths in
+ *  the overlay, "/fragment@N/__overlay__/...", which now live under the
+ *  fragment's target.
+ */
+static int merge_symbols(void *fdto, dt_node_t *targets)
+{
+    int symbols = fdt_path_offset(fdto, "/__symbols__");
+    if (symbols < 0)
+        return 0;
+
+    dt_node_t base = dt_find_node_by_path("/__symbols__", 12);
+    if (!base && !(base = dt_node_alloc(dt_root_node(), "__symbols__")))
+        return ENOMEM;
+
+    for (int prop = fdt_first_property_offset(fdto, symbols); prop >= 0;
+             prop = fdt_next_property_offset(fdto, prop)) {
+        const char *label;
+        int len;
+        const char *path = fdt_getprop_by_offset(fdto, prop, &label, &len);
+
+        /* Labels outside the fragments are of no use to the tree */
+        const char *rest = NULL;
+        int frag = 0;
+        for (int f = fdt_first_subnode(fdto, 0); f >= 0;
+                 f = fdt_next_subnode(fdto, f)) {
+            if (fdt_subnode_offset(fdto, f, "__overlay__") < 0)
+                continue;
+
+            const char *name = fdt_get_name(fdto, f, NULL);
+            size_t name_len = strlen(name);
+            const char *tail = path + 1 + name_len + 12;
+            if (path[0] == '/' && !strncmp(path + 1, name, name_len)
+                    && !strncmp(path + 1 + name_len, "/__overlay__", 12)
+                    && (*tail == '/' || !*tail)) {
+                rest = tail;
+                break;
+            }
+            frag++;
+        }
+        if (!rest)
+            continue;
+
+        const char *prefix = targets[frag]->parent ? targets[frag]->path : "";
+        size_t prefix_len = strlen(prefix), rest_len = strlen(rest);
+
+        char *full = arena_alloc(&overlay_arena, prefix_len + rest_len + 2, 1);
+        if (!full)
+            return ENOMEM;
+        memcpy(full, prefix, prefix_len);
+        memcpy(full + prefix_len, rest, rest_len + 1);
+        if (!full[0])
+            strcpy(full, "/");
+
+        if (!dt_node_set_property(base, label, full, strlen(full) + 1))
+            return ENOMEM;
+    }
+
+    return 0;
+}
+
+static int apply(void *fdto)
+{
+    int rv;
+
+    /* Fix everything up and check everything in the copy before touching
+     * the tree, so that a bad overlay leaves it as it was
+     */
+    uint32_t delta = dt_max_phandle();
+    adjust_phandles(fdto, delta);
+
+    int local = fdt_path_offset(fdto, "/__local_fixups__");
+    if (local >= 0 && (rv = adjust_local_fixups(fdto, local, 0, delta)))
+        return rv;
+
+    if ((rv = resolve_fixups(fdto)))
+        return rv;
+
+    int count = 0;
+    for (int f = fdt_first_subnode(fdto, 0); f >= 0;
+             f = fdt_next_subnode(fdto, f)) {
+        if (fdt_subnode_offset(fdto, f, "__overlay__") >= 0)
+            count++;
+    }
+
+    dt_node_t *targets = arena_alloc(&overlay_arena,
+        (count ? count : 1) * sizeof *targets, _Alignof(dt_node_t));
+    if (!targets)
+        return ENOMEM;
+
+    int i = 0;
+    for (int f = fdt_first_subnode(fdto, 0); f >= 0;
+             f = fdt_next_subnode(fdto, f)) {
+        int overlay = fdt_subnode_offset(fdto, f, "__overlay__");
+        if (overlay < 0)
+            continue;
+
+        if (!(targets[i++] = fragment_target(fdto, f))) {
+            printf("dt: overlay fragment \"%s\" has no target\n",
+                   fdt_get_name(fdto, f, NULL));
+            return ENOENT;
+        }
+        if (!depth_ok(fdto, overlay)) {
+            printf("dt: overlay fragment \"%s\" is nested too deeply\n",
+                   fdt_get_name(fdto, f, NULL));
+            return EINVAL;
+        }
+    }
+
+    i = 0;
+    for (int f = fdt_first_subnode(fdto, 0); f >= 0;
+             f = fdt_next_subnode(fdto, f)) {
+        int overlay = fdt_subnode_offset(fdto, f, "__overlay__");
+        if (overlay >= 0 && (rv = merge_node(targets[i++], fdto, overlay)))
+            return rv;
+    }
+
+    return merge_symbols(fdto, targets);
+}
+
+int dt_overlay_apply(const void *overlay)
+{
+    if (fdt_check_header(overlay))
+        return EINVAL;
+
+    size_t size = fdt_totalsize(overlay);
+    void *fdto = arena_alloc(&overlay_arena, size, sizeof (uint64_t));
+    if (!fdto)
+        return ENOMEM;
+    memcpy(fdto, overlay, size);
+
+    int rv = apply(fdto);
+
+    /* Whatever was merged has been copied into the tree */
+    arena_release(&overlay_arena);
+    return rv;
+}
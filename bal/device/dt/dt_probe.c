@@ -0,0 +1,279 @@
+#include <bal/device/dt.h>
+#include <bal/misc.h>
+#include <bal/arena.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* Bounds of the dt_drivers section, from the linker script */
+extern struct dt_driver __dt_drivers_begin[], __dt_drivers_end[];
+
+/* Drivers by compatible atom. The table is built the first time anything is
+ * probed; the section never changes after link time.
+ */
+struct driver_slot {
+    struct dt_hash_slot     h;
+    const struct dt_driver *driver;
+};
+
+static struct arena         driver_arena = ARENA_INITIALIZER;
+static struct dt_hash_table drivers =
+    DT_HASH_TABLE_INITIALIZER(struct driver_slot, &driver_arena, NULL);
+static bool                 drivers_built = false;
+
+static void build_driver_table(void)
+{
+    for (const struct dt_driver *drv = __dt_drivers_begin;
+             drv != __dt_drivers_end; drv++) {
+        /* Driver names are in the image, so needn't be copied */
+        dt_atom_t atom = dt_intern_borrowed(drv->compatible);
+        struct driver_slot *slot = atom
+            ? dt_hash_insert(&drivers, atom, atom->hash) : NULL;
+        if (!slot)
+            panic("Out of memory building the driver table");
+
+        if (slot->h.key) {
+            printf("dt: more than one driver for \"%s\"\n", drv->compatible);
+            continue;
+        }
+
+        slot->h.key  = atom;
+        slot->h.hash = atom->hash;
+        slot->driver = drv;
+    }
+    drivers_built = true;
+}
+
+/*! Returns the driver for \p compatible, or NULL. Names which were never
+ *  interned can't have a driver, so those cost only the atom lookup.
+ */
+static const struct dt_driver *find_driver(const char *compatible)
+{
+    dt_atom_t atom = dt_atom_lookup(compatible);
+    struct driver_slot *slot = atom
+        ? dt_hash_find(&drivers, atom, atom->hash) : NULL;
+    return slot ? slot->driver : NULL;
+}
+
+static bool node_enabled(dt_node_t node)
+{
+    dt_property_t status = dt_node_find_property_atom(node, &dt_atom_status);
+    if (!status)
+        return true;
+
+    return !strncmp(status->value, "okay", status->value_len)
+        || !strncmp(status->value, "ok", status->value_len);
+}
+
+/* Nodes waiting for their parents to be bound, in the order they were
+ * deferred
+ */
+static dt_node_t deferred = NULL, *deferred_tail = &deferred;
+
+static void defer(dt_node_t node)
+{
+    node->probe_state   = DT_PROBE_DEFERRED;
+    node->deferred_next = NULL;
+    *deferred_tail = node;
+    deferred_tail  = &node->deferred_next;
+}
+
+/*! Probes the nodes which were waiting for \p parent */
+static void retry_deferred(dt_node_t parent)
+{
+    dt_node_t ready = NULL, *ready_tail = &ready;
+
+    /* Take them off the list first; probing them can add to it */
+    deferred_tail = &deferred;
+    while (*deferred_tail) {
+        dt_node_t node = *deferred_tail;
+        if (node->parent == parent) {
+            *deferred_tail = node->deferred_next;
+            node->probe_state   = DT_PROBE_NONE;
+            node->deferred_next = NULL;
+            *ready_tail = node;
+            ready_tail  = &node->deferred_next;
+        } else {
+            deferred_tail = &node->deferred_next;
+        }
+    }
+
+    while (ready) {
+        dt_node_t node = ready;
+        ready = node->deferred_next;
+        dt_probe_node(node);
+    }
+}
+
+gd_device_t dt_probe_node(dt_node_t node)
+{
+    switch (node->probe_state) {
+    case DT_PROBE_DONE:
+        return node->bound_device;
+    case DT_PROBE_ACTIVE:
+    case DT_PROBE_DEFERRED:
+        return NULL;
+    }
+
+    if (!node_enabled(node)) {
+        node->probe_state = DT_PROBE_DONE;
+        return NULL;
+    }
+
+    if (!drivers_built)
+        build_driver_table();
+
+    /* Drivers ask the bus they sit on where they are, so it has to be
+     * bound first. Nothing binds the root, so its children go ahead, and
+     * so do those of a parent which has been probed and has no driver:
+     * waiting for it would be waiting forever.
+     */
+    dt_node_t parent = node->parent;
+    if (parent && parent->parent && !parent->bound_device
+            && !dt_probe_node(parent)) {
+        if (parent->probe_state != DT_PROBE_DONE) {
+            defer(node);
+            return NULL;
+        }
+
+        /* Devices on a disabled bus are off along with it */
+        if (!node_enabled(parent)) {
+            node->probe_state = DT_PROBE_DONE;
+            return NULL;
+        }
+
+        printf("dt: \"%s\" has no driver; probing \"%s\" without it\n",
+               parent->name, node->name);
+    }
+
+    node->probe_state  = DT_PROBE_ACTIVE;
+    node->bound_device = NULL;
+
+    dt_property_t compat = dt_node_find_property_atom(node,
+                                                      &dt_atom_compatible);
+    if (compat) {
+        /* Most specific first; fall back to the next if a driver declines */
+        const char *list = compat->value;
+        for (size_t p = 0; p < compat->value_len;
+                 p += strnlen(list + p, compat->value_len - p) + 1) {
+            const struct dt_driver *drv = find_driver(list + p);
+            if (drv && (node->bound_device = drv->attach(node)))
+                break;
+        }
+    }
+
+    /* Whether or not it bound, nothing left waiting on it need wait longer */
+    node->probe_state = DT_PROBE_DONE;
+    retry_deferred(node);
+
+    return node->bound_device;
+}
+
+/* Stands in as the bound device of a node until something uses it */
+struct dt_lazy_device {
+    GD_DEVICE;
+    dt_node_t node;
+};
+
+static int lazy_get_dt_node(struct dt_lazy_device *dev, dt_node_t *pnode)
+{
+    *pnode = dev->node;
+    return 0;
+}
+
+static int lazy_forward(gd_device_t dev_, unsigned forward, unsigned ioctl,
+                        va_list *pap)
+{
+    struct dt_lazy_device *dev = (struct dt_lazy_device *) dev_;
+
+    gd_device_t real = dt_probe_node(dev->node);
+    if (!real)
+        return ENODEV;
+
+    return real->ioctl(real, forward, ioctl, pap);
+}
+
+static GD_BEGIN_IOCTL_MAP(struct dt_lazy_device *, lazy_ioctl)
+    GD_MAP_DEVICE_GET_DT_NODE_IOCTL(lazy_get_dt_node)
+GD_END_IOCTL_MAP_FORWARD(lazy_forward)
+
+static void probe_lazily(dt_node_t node)
+{
+    if (node->probe_state != DT_PROBE_NONE || !node_enabled(node))
+        return;
+
+    struct dt_lazy_device *dev = arena_alloc(&driver_arena, sizeof *dev,
+                                             _Alignof(struct dt_lazy_device));
+    if (!dev)
+        panic("Out of memory deferring \"%s\"", node->name);
+
+    dev->ioctl = lazy_ioctl;
+    dev->node  = node;
+    node->bound_device = &dev->dev;
+    node->probe_state  = DT_PROBE_LAZY;
+}
+
+/*! Returns the node /chosen names as the console, or NULL */
+static dt_node_t find_stdout(dt_node_t root)
+{
+    dt_node_t chosen = dt_node_find_child(root, "chosen");
+    if (!chosen)
+        return NULL;
+
+    dt_property_t prop = dt_node_find_property(chosen, "stdout-path");
+    if (!prop)
+        prop = dt_node_find_property(chosen, "linux,stdout-path");
+    if (!prop)
+        return NULL;
+
+    /* Anything after a ':' is options, such as the baud rate */
+    const char *path = prop->value;
+    size_t len = strnlen(path, prop->value_len);
+    const char *colon = memchr(path, ':', len);
+    if (colon)
+        len = colon - path;
+
+    if (len && path[0] != '/') {
+        char alias[64];
+        dt_node_t aliases = dt_node_find_child(root, "aliases");
+        if (!aliases || len >= sizeof alias)
+            return NULL;
+
+        memcpy(alias, path, len);
+        alias[len] = 0;
+        if (!(prop = dt_node_find_property(aliases, alias)))
+            return NULL;
+
+        path = prop->value;
+        len  = strnlen(path, prop->value_len);
+    }
+
+    return dt_find_node_by_path(path, len);
+}
+
+void dt_probe_all(void)
+{
+    dt_node_t root = dt_root_node();
+    if (!root)
+        return;
+
+    if (!drivers_built)
+        build_driver_table();
+
+    /* The console, and the buses it sits on, come up straight away */
+    dt_node_t console = find_stdout(root);
+    if (console)
+        dt_probe_node(console);
+
+    /* Everything else waits until it is used */
+    for (uint32_t i = 0; i < drivers.capacity; i++) {
+        const struct driver_slot *slot = dt_hash_slot_at(&drivers, i);
+        if (!slot->h.key)
+            continue;
+
+        dt_atom_t atom = slot->h.key;
+        for (const struct dt_node_list *l = dt_find_compatible(atom->name);
+                 l; l = l->next)
+            probe_lazily(l->node);
+    }
+}
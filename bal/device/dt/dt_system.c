@@ -1,8 +1,10 @@
 #include <bal/device/dt.h>
 #include <bal/misc.h>
 #include <bal/mmap.h>
+#include <bal/arena.h>
 #include <libfdt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
@@ -11,6 +13,251 @@
 void *system_fdt;
 static dt_node_t dt_root;
 
+/*! Memory ranges found in the FDT are collected and added to the memory map
+ *  as one batch. Nothing can be allocated until they are, so the batch is
+ *  static; if a tree has more ranges than fit, they go in in several.
+ */
+#define MMAP_BATCH 256
+static gd_memory_map_entry mmap_batch[MMAP_BATCH];
+static size_t mmap_batched = 0;
+
+static void flush_memory_ranges(void)
+{
+    mmap_add_entries(mmap_batch, mmap_batched);
+    mmap_batched = 0;
+}
+
+static void add_memory_range(gd_memory_map_entry ent)
+{
+    if (mmap_batched == MMAP_BATCH)
+        flush_memory_ranges();
+    mmap_batch[mmap_batched++] = ent;
+}
+
+/*! Firmware carve-outs. Like E820 reserved ranges, these are unusable, which
+ *  takes precedence over the memory nodes they sit in.
+ */
+static void add_reserved_range(uint64_t base, uint64_t size,
+                               gd_memory_map_attribute attributes)
+{
+    gd_memory_map_entry ent = {
+        .type           = gd_unusable_memory,
+        .physical_start = base,
+        .virtual_start  = base,
+        .size           = size,
+        .attributes     = attributes,
+    };
+
+    printf("Adding reserved memory region: %" PRIX64 " len=%" PRIX64 "\n",
+        base, size);
+    add_memory_range(ent);
+}
+
+/*! What the scan has seen of a node on the path from the root down to where
+ *  it is. A node's properties come before its children in the blob, so they
+ *  are all known by the time its first child or its end is reached.
+ */
+struct scan_node {
+    dt_node_t      node;
+    int            offset;
+    /* #address-cells and #size-cells, for the node's children */
+    unsigned       addr_cells, size_cells;
+    /* reg, which is reg_len bytes long */
+    const fdt32_t *reg;
+    int            reg_len;
+    const fdt32_t *numa;
+    /* device_type = "memory" */
+    bool           memory;
+    bool           disabled;
+    bool           reusable;
+    /* Has a size property */
+    bool           sized;
+    /* The node is /reserved-memory */
+    bool           reserved_memory;
+};
+
+/*! Adds the ranges of a device_type = "memory" node */
+static void add_memory_node(const struct scan_node *node,
+                            const struct scan_node *root)
+{
+    unsigned addr_cells = root->addr_cells, size_cells = root->size_cells;
+    unsigned cells = addr_cells + size_cells;
+
+    const fdt32_t *p = node->reg;
+    for (int i = 0; p && cells && i + cells <= node->reg_len / sizeof *p;
+             i += cells) {
+        uint64_t base_addr = dt_read_cells(&p[i], addr_cells);
+        uint64_t base_size = dt_read_cells(&p[i + addr_cells], size_cells);
+
+        printf("Adding memory range %16" PRIX64 " len %16" PRIX64 "\n",
+            base_addr, base_size);
+
+        gd_memory_map_entry ent = { 0 };
+        ent.type       = gd_conventional_memory;
+        ent.attributes = 0;
+        ent.virtual_start = ent.physical_start = base_addr;
+        ent.size = base_size;
+        add_memory_range(ent);
+
+        if (node->numa)
+            mmap_add_node_range(base_addr, base_size,
+                                dt_read_cells(node->numa, 1));
+    }
+}
+
+/* /reserved-memory children with a size but no reg, which we place once the
+ * rest of memory is known
+ */
+#define MAX_DYNAMIC_RESERVATIONS 32
+static struct dynamic_reservation {
+    int      offset;
+    bool     reusable;
+    uint64_t base;
+    uint64_t size;
+} dynamic[MAX_DYNAMIC_RESERVATIONS];
+static unsigned ndynamic = 0;
+static unsigned resmem_addr_cells, resmem_size_cells;
+/* The /reserved-memory node, whichever unit address it has; its offset is
+ * found by the memory scan and its node by the node scan
+ */
+static int       resmem_offset = -1;
+static dt_node_t resmem_node   = NULL;
+
+static bool found_memory = false;
+
+/*! Takes the cell counts of /reserved-memory for its children */
+static void set_reserved_memory_cells(const struct scan_node *resmem)
+{
+    resmem_offset     = resmem->offset;
+    resmem_addr_cells = resmem->addr_cells;
+    resmem_size_cells = resmem->size_cells;
+    if (resmem_addr_cells > 2 || resmem_size_cells > 2)
+        panic("dt: /reserved-memory with more than 2 cells");
+}
+
+/*! Adds the static ranges of a /reserved-memory child, or notes it to be
+ *  placed later if it only has a size
+ */
+static void add_reserved_memory(const struct scan_node *node)
+{
+    unsigned cells = resmem_addr_cells + resmem_size_cells;
+
+    /* Regions the OS may reuse are still kept from the loader */
+    gd_memory_map_attribute attributes = 0;
+    if (node->reusable)
+        attributes |= GD_MEMORY_SP;
+
+    const fdt32_t *reg = node->reg;
+    if (reg) {
+        for (int i = 0; cells && i + cells <= node->reg_len / sizeof *reg;
+                 i += cells) {
+            add_reserved_range(dt_read_cells(&reg[i], resmem_addr_cells),
+                dt_read_cells(&reg[i + resmem_addr_cells], resmem_size_cells),
+                attributes);
+        }
+    } else if (node->sized) {
+        if (ndynamic == MAX_DYNAMIC_RESERVATIONS)
+            panic("dt: too many dynamic memory reservations");
+        dynamic[ndynamic].offset   = node->offset;
+        dynamic[ndynamic].reusable = node->reusable;
+        ndynamic++;
+    }
+}
+
+/*! Places the dynamic reservations, within their alloc-ranges if given */
+static void place_dynamic_reservations(void *fdt)
+{
+    unsigned cells = resmem_addr_cells + resmem_size_cells;
+
+    for (unsigned d = 0; d < ndynamic; d++) {
+        struct dynamic_reservation *res = &dynamic[d];
+        const char *name = fdt_get_name(fdt, res->offset, NULL);
+
+        int len;
+        const fdt32_t *p = fdt_getprop(fdt, res->offset, "size", &len);
+        if (len != (int) (resmem_size_cells * sizeof *p))
+            continue;
+        res->size = dt_read_cells(p, resmem_size_cells);
+
+        uint64_t align = 4096;
+        p = fdt_getprop(fdt, res->offset, "alignment", &len);
+        if (p && len == (int) (resmem_size_cells * sizeof *p))
+            align = dt_read_cells(p, resmem_size_cells);
+
+        size_t pages = (res->size + 4095) / 4096;
+        void *addr = NULL;
+        int rv = ENOMEM;
+
+        p = fdt_getprop(fdt, res->offset, "alloc-ranges", &len);
+        if (p) {
+            for (int i = 0; rv && cells && i + cells <= len / sizeof *p;
+                     i += cells) {
+                uint64_t base = dt_read_cells(&p[i], resmem_addr_cells);
+                uint64_t size = dt_read_cells(&p[i + resmem_addr_cells],
+                                           resmem_size_cells);
+                if (size)
+                    rv = gd_alloc_pages_constrained(gd_unusable_memory, &addr,
+                        pages, align, base, base + size - 1, 0);
+            }
+        } else {
+            rv = gd_alloc_pages_constrained(gd_unusable_memory, &addr, pages,
+                align, 0, UINT64_MAX, 0);
+        }
+
+        if (rv) {
+            printf("dt: unable to place reserved memory \"%s\"\n", name);
+            res->size = 0;
+            continue;
+        }
+
+        res->base = (uintptr_t) addr;
+        if (res->reusable) {
+            /* Described just like the static reusable regions */
+            mmap_add_entry((gd_memory_map_entry) {
+                .type           = gd_unusable_memory,
+                .physical_start = res->base,
+                .virtual_start  = res->base,
+                .size           = pages * 4096,
+                .attributes     = GD_MEMORY_SP,
+            });
+        }
+        printf("Placed reserved memory \"%s\" at %" PRIX64 " len=%" PRIX64 "\n",
+            name, res->base, res->size);
+    }
+}
+
+/*! Records where the dynamic reservations went in the tree, so that the OS
+ *  finds them where we put them
+ */
+static void record_dynamic_reservations(void)
+{
+    for (unsigned d = 0; resmem_node && d < ndynamic; d++) {
+        struct dynamic_reservation *res = &dynamic[d];
+        if (!res->size)
+            continue;
+
+        fdt32_t reg[4];
+        unsigned n = 0;
+        for (unsigned i = resmem_addr_cells; i-- > 0;)
+            reg[n++] = cpu_to_fdt32(i < 2 ? res->base >> (32 * i) : 0);
+        for (unsigned i = resmem_size_cells; i-- > 0;)
+            reg[n++] = cpu_to_fdt32(i < 2 ? res->size >> (32 * i) : 0);
+
+        dt_node_t node = dt_node_find_child(resmem_node,
+            fdt_get_name(system_fdt, res->offset, NULL));
+        if (node && !dt_node_set_property(node, "reg", reg, n * sizeof *reg))
+            panic("Out of memory recording reserved memory");
+    }
+}
+
+/* Properties are read in from the FDT as they are used. Define DT_EAGER to 1
+ * to read and print all of them up front instead.
+ */
+#ifndef DT_EAGER
+#define DT_EAGER 0
+#endif
+
+#if DT_EAGER
 static void print_dtval(const char *val, size_t len)
 {
     for (size_t i = 0; i < len; i++) {
@@ -21,44 +268,271 @@ static void print_dtval(const char *val, size_t len)
     }
 }
 
-static dt_node_t add_device_fdt(dt_node_t parent, void *fdt, int fdt_node, int depth)
+static void expand_device(dt_node_t n, int depth)
 {
-    const char *name = fdt_get_name(fdt, fdt_node, NULL);
-    printf("%*cEnumerating \"%s\"\n", depth, ' ', name);
-    dt_node_t n = dt_node_alloc(parent, name);
-    if (!n)
-        panic("Out of memory enumerating node \"%s\"\n", name);
+    printf("%*cEnumerating \"%s\"\n", depth, ' ', n->name);
 
-    for (int propoff = fdt_first_property_offset(fdt, fdt_node);
-             propoff >= 0;
-             propoff = fdt_next_property_offset(fdt, propoff)) {
-        int len;
-        const struct fdt_property *fdt_prop =
-            fdt_get_property_by_offset(fdt, propoff, &len);
+    for (size_t i = 0; i < dt_node_property_count(n); i++) {
+        dt_property_t prop = dt_node_property(n, i);
+        printf("%*c \"%s\" = \"", depth, ' ', prop->name);
+        print_dtval(prop->value, prop->value_len);
+        printf("\"\n");
+    }
+
+    for (size_t i = 0; i < dt_node_child_count(n); i++)
+        expand_device(dt_node_child(n, i), depth + 2);
+}
+#endif
+
+dt_node_t dt_root_node(void)
+{
+    return dt_root;
+}
+
+/* Indexes built as the FDT is ingested, in their own arena */
+static struct arena dt_index_arena = ARENA_INITIALIZER;
+
+/* Deepest FDT nesting we index */
+#define DT_MAX_DEPTH 32
 
-        if (!fdt_prop) {
-            panic("Error getting property of \"%s\": %s\n",
-                name, fdt_strerror(len));
+/* Phandles 0 and ~0 are invalid, so the phandle itself is the key */
+struct phandle_slot {
+    struct dt_hash_slot h;
+    dt_node_t           node;
+};
+static struct dt_hash_table phandles =
+    DT_HASH_TABLE_INITIALIZER(struct phandle_slot, &dt_index_arena, NULL);
+static uint32_t phandles_max = 0;
+
+/* Keyed by compatible atom */
+struct compatible_slot {
+    struct dt_hash_slot  h;
+    struct dt_node_list *head, *tail;
+};
+static struct dt_hash_table compatibles =
+    DT_HASH_TABLE_INITIALIZER(struct compatible_slot, &dt_index_arena, NULL);
+
+static uint32_t phandle_hash(uint32_t phandle)
+{
+    return phandle * 2654435761u;
+}
+
+#define PHANDLE_KEY(phandle) ((const void *) (uintptr_t) (phandle))
+
+void dt_index_phandle(uint32_t phandle, dt_node_t node)
+{
+    struct phandle_slot *slot = dt_hash_insert(&phandles,
+        PHANDLE_KEY(phandle), phandle_hash(phandle));
+    if (!slot)
+        panic("Out of memory indexing the device tree");
+
+    if (slot->node == node)
+        return;
+    if (slot->h.key) {
+        printf("dt: duplicate phandle %" PRIx32 " on \"%s\"\n",
+               phandle, node->name);
+        return;
+    }
+
+    slot->h.key  = PHANDLE_KEY(phandle);
+    slot->h.hash = phandle_hash(phandle);
+    slot->node   = node;
+    if (phandle > phandles_max)
+        phandles_max = phandle;
+}
+
+uint32_t dt_max_phandle(void)
+{
+    return phandles_max;
+}
+
+void dt_index_compatible(const char *compatible, dt_node_t node)
+{
+    dt_atom_t atom = dt_intern_borrowed(compatible);
+    if (!atom)
+        panic("Out of memory indexing the device tree");
+
+    struct compatible_slot *slot = dt_hash_insert(&compatibles, atom,
+                                                  atom->hash);
+    if (!slot)
+        panic("Out of memory indexing the device tree");
+
+    /* A node listing the same string twice */
+    if (slot->h.key && slot->tail->node == node)
+        return;
+
+    struct dt_node_list *link = arena_alloc(&dt_index_arena, sizeof *link,
+                                            _Alignof(struct dt_node_list));
+    if (!link)
+        panic("Out of memory indexing the device tree");
+
+    link->node = node;
+    link->next = NULL;
+
+    if (!slot->h.key) {
+        slot->h.key  = atom;
+        slot->h.hash = atom->hash;
+        slot->head   = link;
+    } else {
+        slot->tail->next = link;
+    }
+    slot->tail = link;
+}
+
+/* The blob is read in two passes over its structure block, both by
+ * scan_fdt. Nothing can be allocated until the memory map is complete, so the
+ * first pass only finds memory and the reservations in it; the second reads
+ * every node into the tree. Going through libfdt's lookups instead rescans
+ * the block from the top or skips whole subtrees for every node.
+ */
+enum scan_pass {
+    SCAN_MEMORY,
+    SCAN_NODES,
+};
+
+static bool is_reserved_memory(const char *name)
+{
+    return !strcmp(name, "reserved-memory")
+        || !strncmp(name, "reserved-memory@", 16);
+}
+
+static void scan_begin_node(void *fdt, enum scan_pass pass,
+                            struct scan_node *stack, int depth, int offset)
+{
+    struct scan_node *node = &stack[depth];
+    *node = (struct scan_node) {
+        .offset     = offset,
+        .addr_cells = 2,
+        .size_cells = 1,
+    };
+
+    if (pass == SCAN_NODES) {
+        node->node = dt_node_alloc_fdt(depth ? stack[depth - 1].node : NULL,
+                                       offset);
+        if (!node->node)
+            panic("Out of memory reading the device tree");
+        if (!depth)
+            dt_root = node->node;
+        else if (offset == resmem_offset)
+            resmem_node = node->node;
+    } else if (depth == 1) {
+        node->reserved_memory =
+            is_reserved_memory(fdt_get_name(fdt, offset, NULL));
+    } else if (depth == 2 && stack[1].reserved_memory) {
+        set_reserved_memory_cells(&stack[1]);
+    }
+}
+
+static void scan_property(enum scan_pass pass, struct scan_node *node,
+                          const char *name, const char *value, int len)
+{
+    if (pass == SCAN_NODES) {
+        /* Properties are read in when first used; only the indexes are
+         * built now
+         */
+        if (!strcmp(name, "compatible")) {
+            for (int p = 0; p < len; p += strlen(value + p) + 1)
+                dt_index_compatible(value + p, node->node);
+        } else if (len == sizeof (fdt32_t) && (!strcmp(name, "phandle")
+                || !strcmp(name, "linux,phandle"))) {
+            uint32_t phandle = dt_read_cells(value, 1);
+            if (phandle && phandle != ~(uint32_t) 0)
+                dt_index_phandle(phandle, node->node);
         }
+        return;
+    }
 
-        const char *prop_name = fdt_string(fdt, fdt32_to_cpu(fdt_prop->nameoff));
+    if (!strcmp(name, "#address-cells") && len == sizeof (fdt32_t)) {
+        node->addr_cells = dt_read_cells(value, 1);
+    } else if (!strcmp(name, "#size-cells") && len == sizeof (fdt32_t)) {
+        node->size_cells = dt_read_cells(value, 1);
+    } else if (!strcmp(name, "device_type")) {
+        node->memory = len == sizeof "memory"
+                    && !memcmp(value, "memory", sizeof "memory");
+    } else if (!strcmp(name, "status")) {
+        node->disabled = len > 0 && strcmp(value, "okay")
+                      && strcmp(value, "ok");
+    } else if (!strcmp(name, "reg")) {
+        node->reg     = (const fdt32_t *) value;
+        node->reg_len = len;
+    } else if (!strcmp(name, "numa-node-id") && len == sizeof (fdt32_t)) {
+        node->numa = (const fdt32_t *) value;
+    } else if (!strcmp(name, "reusable")) {
+        node->reusable = true;
+    } else if (!strcmp(name, "size")) {
+        node->sized = true;
+    }
+}
 
-        printf("%*c \"%s\" = \"", depth, ' ', prop_name);
-        print_dtval(fdt_prop->data, len);
-        printf("\"\n");
+static void scan_end_node(enum scan_pass pass, struct scan_node *stack,
+                          int depth)
+{
+    struct scan_node *node = &stack[depth];
+    if (pass != SCAN_MEMORY || node->disabled)
+        return;
 
-        if (!dt_node_set_property(n, prop_name, fdt_prop->data, len))
-            panic("Out of memory allocating \"%s\":\"%s\"",
-                name, prop_name);
+    if (depth == 1 && node->memory) {
+        add_memory_node(node, &stack[0]);
+        found_memory = true;
+    } else if (depth == 2 && stack[1].reserved_memory) {
+        add_reserved_memory(node);
     }
+}
+
+/*! Makes pass \p pass over the structure block of \p fdt */
+static void scan_fdt(void *fdt, enum scan_pass pass)
+{
+    struct scan_node stack[DT_MAX_DEPTH];
+    int depth = -1, next;
+
+    for (int offset = 0;; offset = next) {
+        switch (fdt_next_tag(fdt, offset, &next)) {
+        case FDT_BEGIN_NODE:
+            if (++depth >= DT_MAX_DEPTH)
+                panic("dt: nodes nested more than %d deep", DT_MAX_DEPTH);
+            scan_begin_node(fdt, pass, stack, depth, offset);
+            break;
+
+        case FDT_PROP: {
+            int len;
+            const struct fdt_property *prop =
+                fdt_get_property_by_offset(fdt, offset, &len);
+            scan_property(pass, &stack[depth],
+                          fdt_string(fdt, fdt32_to_cpu(prop->nameoff)),
+                          prop->data, len);
+            break;
+        }
+
+        case FDT_END_NODE:
+            scan_end_node(pass, stack, depth);
+            if (--depth < 0)
+                return;
+            break;
 
-    for (int suboff = fdt_first_subnode(fdt, fdt_node);
-             suboff != -FDT_ERR_NOTFOUND;
-             suboff = fdt_next_subnode(fdt, suboff)) {
-        add_device_fdt(n, fdt, suboff, depth + 2);
+        case FDT_END:
+            if (next < 0)
+                panic("dt: bad FDT structure: %s", fdt_strerror(next));
+            return;
+        }
     }
+}
 
-    return n;
+dt_node_t dt_find_by_phandle(uint32_t phandle)
+{
+    if (!phandle)
+        return NULL;
+
+    struct phandle_slot *slot = dt_hash_find(&phandles, PHANDLE_KEY(phandle),
+                                             phandle_hash(phandle));
+    return slot ? slot->node : NULL;
+}
+
+const struct dt_node_list *dt_find_compatible(const char *compatible)
+{
+    dt_atom_t atom = compatibles.count ? dt_atom_lookup(compatible) : NULL;
+    struct compatible_slot *slot = atom
+        ? dt_hash_find(&compatibles, atom, atom->hash) : NULL;
+    return slot ? slot->head : NULL;
 }
 
 void dt_platform_init_fdt(void *fdt)
@@ -74,63 +548,40 @@ void dt_platform_init_fdt(void *fdt)
     }
 
     // Process memory reservations
-    printf("rsv %p\n", fdt);
     int num_rsv = fdt_num_mem_rsv(fdt);
     for (int i = 0; i < num_rsv; i++) {
-        printf("get\n");
-        gd_memory_map_entry ent;
-        ent.type = gd_reserved_memory_type;
-        ent.attributes = 0;
-        fdt_get_mem_rsv(fdt, i, &ent.physical_start, &ent.size);
-        printf("got\n");
-        ent.virtual_start = ent.physical_start;
-
-        printf("Adding reserved memory region: %" PRIX64 " len=%" PRIX64 "\n",
-            ent.physical_start, ent.size);
-
-        mmap_add_entry(ent);
+        uint64_t base, size;
+        fdt_get_mem_rsv(fdt, i, &base, &size);
+        add_reserved_range(base, size, 0);
     }
 
-    // Process root note memory entries
-    printf("root\n");
-    int root = fdt_next_node(fdt, -1, NULL);
+    // Process the memory nodes and /reserved-memory
+    scan_fdt(fdt, SCAN_MEMORY);
+    if (!found_memory)
+        panic("Unable to locate memory node\n");
 
-    unsigned addr_cells = fdt_address_cells(fdt, root);
-    unsigned size_cells = fdt_size_cells(fdt, root);
-    unsigned cells      = addr_cells + size_cells;
+    /* Properties are read straight out of the blob, so it must be kept out
+     * of the way of allocations from the very first one. It is whole pages
+     * of loader data, rather than partial pages which would become unusable.
+     */
+    uint64_t fdt_start = (uintptr_t) fdt & ~(uint64_t) 0xFFF;
+    uint64_t fdt_end   = ((uintptr_t) fdt + fdt_totalsize(fdt) + 0xFFF)
+                       & ~(uint64_t) 0xFFF;
+    add_memory_range((gd_memory_map_entry) {
+        .type           = gd_loader_data,
+        .physical_start = fdt_start,
+        .virtual_start  = fdt_start,
+        .size           = fdt_end - fdt_start,
+    });
 
-    int mem_offs = fdt_subnode_offset(fdt, root, "memory");
-    if (mem_offs < 0) {
-        panic("Unable to locate memory node (%s)\n", fdt_strerror(mem_offs));
-    }
+    flush_memory_ranges();
+    place_dynamic_reservations(fdt);
 
-    int memlen;
-    const uint32_t *p = fdt_getprop(system_fdt, mem_offs, "reg", &memlen);
-    for (int i = 0; i < memlen / 4; i+= cells) {
-        uint64_t base_addr = 0, base_size = 0;
-        if (addr_cells == 1) {
-            base_addr = fdt32_to_cpu(p[i]);
-        } else if (addr_cells == 2) {
-            base_addr = fdt64_to_cpu(((uint64_t) p[i + 1]) << 32 | p[i]);
-        }
-
-        if (size_cells == 1) {
-            base_size = fdt32_to_cpu(p[i + addr_cells]);
-        } else if (size_cells == 2) {
-            base_size = fdt64_to_cpu(((uint64_t) p[i + addr_cells + 1]) << 32
-            | p[i + addr_cells]);
-        }
-
-        printf("Adding memory range %16" PRIX64 " len %16" PRIX64 "\n",
-            base_addr, base_size);
-
-        gd_memory_map_entry ent = { 0 };
-        ent.type       = gd_conventional_memory;
-        ent.attributes = 0;
-        ent.virtual_start = ent.physical_start = base_addr;
-        ent.size = base_size;
-        mmap_add_entry(ent);
-    }
+    scan_fdt(fdt, SCAN_NODES);
+    record_dynamic_reservations();
+#if DT_EAGER
+    expand_device(dt_root, 0);
+#endif
 
-    dt_root = add_device_fdt(NULL, fdt, root, 0);
+    dt_probe_all();
 }
@@ -1,58 +1,506 @@
 #include <bal/device/dt.h>
 #include <bal/misc.h>
-#include <gd_tree.h>
+#include <bal/arena.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <libfdt.h>
 
-RB_GENERATE(dt_properties, dt_property, rbnode, dt_property_cmp)
-RB_GENERATE(dt_nodes,      dt_node,     rbnode, dt_node_cmp)
+/* The tree is only ever added to, so everything in it comes from here */
+static struct arena dt_arena = ARENA_INITIALIZER;
 
-int dt_property_cmp(dt_property_t lhs, dt_property_t rhs)
+dt_node_t dt_dirty_nodes  = NULL;
+uint32_t  dt_change_count = 0;
+
+static void dt_node_changed(dt_node_t node)
+{
+    dt_change_count++;
+    if (!node->dirty) {
+        node->dirty      = true;
+        node->dirty_next = dt_dirty_nodes;
+        dt_dirty_nodes   = node;
+    }
+}
+
+/*! FNV-1a */
+static uint32_t dt_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash;
+}
+
+static uint32_t dt_hash_n(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return hash;
+}
+
+/* Hash tables for the tree and the indexes kept alongside it */
+
+static struct dt_hash_slot *dt_hash_probe(const struct dt_hash_table *table,
+                                          const void *key, uint32_t hash)
+{
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        struct dt_hash_slot *slot = dt_hash_slot_at(table, i);
+        if (!slot->key || (slot->hash == hash && (table->match
+                ? table->match(key, slot->key) : slot->key == key)))
+            return slot;
+    }
+}
+
+static bool dt_hash_grow(struct dt_hash_table *table)
+{
+    uint32_t capacity = table->capacity ? table->capacity * 2 : 64;
+    void *slots = arena_alloc(table->arena, capacity * table->slot_size,
+                              sizeof (void*));
+    if (!slots)
+        return false;
+    memset(slots, 0, capacity * table->slot_size);
+
+    struct dt_hash_table old = *table;
+    table->slots    = slots;
+    table->capacity = capacity;
+
+    /* Keys in the table are distinct, so each goes in the first free slot */
+    for (uint32_t i = 0; i < old.capacity; i++) {
+        struct dt_hash_slot *from = dt_hash_slot_at(&old, i);
+        if (!from->key)
+            continue;
+
+        struct dt_hash_slot *to;
+        uint32_t j = from->hash & (capacity - 1);
+        while ((to = dt_hash_slot_at(table, j))->key)
+            j = (j + 1) & (capacity - 1);
+        memcpy(to, from, table->slot_size);
+    }
+    return true;
+}
+
+void *dt_hash_find(const struct dt_hash_table *table, const void *key,
+                   uint32_t hash)
+{
+    if (!table->count)
+        return NULL;
+
+    struct dt_hash_slot *slot = dt_hash_probe(table, key, hash);
+    return slot->key ? slot : NULL;
+}
+
+void *dt_hash_insert(struct dt_hash_table *table, const void *key,
+                     uint32_t hash)
+{
+    if (table->count) {
+        struct dt_hash_slot *slot = dt_hash_probe(table, key, hash);
+        if (slot->key)
+            return slot;
+    }
+
+    if ((table->count + 1) * 2 > table->capacity && !dt_hash_grow(table))
+        return NULL;
+
+    table->count++;
+    return dt_hash_probe(table, key, hash);
+}
+
+struct dt_atom dt_atom_compatible    = { 0, "compatible" };
+struct dt_atom dt_atom_reg           = { 0, "reg" };
+struct dt_atom dt_atom_ranges        = { 0, "ranges" };
+struct dt_atom dt_atom_address_cells = { 0, "#address-cells" };
+struct dt_atom dt_atom_size_cells    = { 0, "#size-cells" };
+struct dt_atom dt_atom_status        = { 0, "status" };
+struct dt_atom dt_atom_interrupts    = { 0, "interrupts" };
+struct dt_atom dt_atom_phandle       = { 0, "phandle" };
+
+static struct dt_atom *const dt_builtin_atoms[] = {
+    &dt_atom_compatible, &dt_atom_reg, &dt_atom_ranges,
+    &dt_atom_address_cells, &dt_atom_size_cells, &dt_atom_status,
+    &dt_atom_interrupts, &dt_atom_phandle,
+};
+
+static bool dt_atom_match(const void *key, const void *slot_key)
+{
+    return !strcmp(key, slot_key);
+}
+
+/* Interned atoms, by name */
+struct dt_atom_slot {
+    struct dt_hash_slot h;
+    dt_atom_t           atom;
+};
+static struct dt_hash_table dt_atoms =
+    DT_HASH_TABLE_INITIALIZER(struct dt_atom_slot, &dt_arena, dt_atom_match);
+
+/*! Adds \p atom, which is new, to the table */
+static bool dt_atoms_add(dt_atom_t atom)
+{
+    struct dt_atom_slot *slot = dt_hash_insert(&dt_atoms, atom->name,
+                                               atom->hash);
+    if (!slot)
+        return false;
+
+    slot->h.key  = atom->name;
+    slot->h.hash = atom->hash;
+    slot->atom   = atom;
+    return true;
+}
+
+/*! Interns the builtin atoms, ahead of everything else */
+static bool dt_atoms_init(void)
+{
+    if (dt_atoms.count)
+        return true;
+
+    for (size_t i = 0; i < sizeof dt_builtin_atoms / sizeof *dt_builtin_atoms; i++) {
+        struct dt_atom *atom = dt_builtin_atoms[i];
+        atom->hash = dt_hash(atom->name);
+        if (!dt_atoms_add(atom))
+            return false;
+    }
+    return true;
+}
+
+/*! Interns \p name. If \p copy is false, \p name is referenced rather than
+ *  copied, and must stay valid for the life of the tree.
+ */
+static dt_atom_t dt_intern_name(const char *name, bool copy)
+{
+    if (!dt_atoms_init())
+        return NULL;
+
+    uint32_t hash = dt_hash(name);
+    struct dt_atom_slot *slot = dt_hash_find(&dt_atoms, name, hash);
+    if (slot)
+        return slot->atom;
+
+    struct dt_atom *atom = arena_alloc(&dt_arena, sizeof *atom,
+                                       _Alignof(struct dt_atom));
+    if (!atom)
+        return NULL;
+
+    atom->hash = hash;
+    atom->name = copy ? arena_strdup(&dt_arena, name) : name;
+    if (!atom->name || !dt_atoms_add(atom))
+        return NULL;
+
+    return atom;
+}
+
+dt_atom_t dt_intern(const char *name)
+{
+    return dt_intern_name(name, true);
+}
+
+dt_atom_t dt_intern_borrowed(const char *name)
+{
+    return dt_intern_name(name, false);
+}
+
+dt_atom_t dt_atom_lookup(const char *name)
+{
+    if (!dt_atoms_init())
+        return NULL;
+
+    struct dt_atom_slot *slot = dt_hash_find(&dt_atoms, name, dt_hash(name));
+    return slot ? slot->atom : NULL;
+}
+
+/* Nodes by full path. Lookups go by a path which needn't be terminated. */
+struct dt_path_key {
+    const char *path;
+    size_t      len;
+};
+
+static bool dt_path_match(const void *key_, const void *slot_key)
+{
+    const struct dt_path_key *key = key_;
+    dt_node_t node = (dt_node_t) slot_key;
+    return node->path_len == key->len && !memcmp(node->path, key->path,
+                                                 key->len);
+}
+
+/* Slots are bare; the key is the node */
+static struct dt_hash_table dt_paths =
+    DT_HASH_TABLE_INITIALIZER(struct dt_hash_slot, &dt_arena, dt_path_match);
+
+static bool dt_paths_insert(dt_node_t node)
+{
+    struct dt_path_key key = { node->path, node->path_len };
+    uint32_t hash = dt_hash_n(node->path, node->path_len);
+
+    struct dt_hash_slot *slot = dt_hash_insert(&dt_paths, &key, hash);
+    if (!slot)
+        return false;
+    if (!slot->key) {
+        slot->key  = node;
+        slot->hash = hash;
+    }
+    return true;
+}
+
+/*! Works out the path of \p node, which has just been named and parented,
+ *  and indexes it
+ */
+static bool dt_node_set_path(dt_node_t node)
+{
+    if (!node->parent) {
+        node->path     = "/";
+        node->path_len = 1;
+    } else {
+        /* Children of the root don't get a second '/' */
+        size_t prefix = node->parent->parent ? node->parent->path_len : 0;
+        size_t len    = strlen(node->name);
+
+        char *path = arena_alloc(&dt_arena, prefix + len + 2, 1);
+        if (!path)
+            return false;
+
+        memcpy(path, node->parent->path, prefix);
+        path[prefix] = '/';
+        memcpy(path + prefix + 1, node->name, len + 1);
+
+        node->path     = path;
+        node->path_len = prefix + len + 1;
+    }
+
+    return dt_paths_insert(node);
+}
+
+/*! Returns the index of the first slot in \p slots which doesn't sort before
+ *  \p hash and \p name
+ */
+static uint32_t dt_slots_lower_bound(const struct dt_slots *slots,
+                                     uint32_t hash, const char *name)
+{
+    uint32_t lo = 0, hi = slots->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct dt_slot *slot = &slots->slots[mid];
+        if (slot->hash < hash
+                || (slot->hash == hash && strcmp(slot->name, name) < 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*! Slot names are all interned, so after finding where the hash starts this
+ *  compares pointers
+ */
+static void *dt_slots_find(const struct dt_slots *slots, dt_atom_t atom)
+{
+    uint32_t lo = 0, hi = slots->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (slots->slots[mid].hash < atom->hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < slots->count && slots->slots[lo].hash == atom->hash; lo++) {
+        if (slots->slots[lo].name == atom->name)
+            return slots->slots[lo].item;
+    }
+    return NULL;
+}
+
+/*! Makes room for \p count more slots. Outgrown arrays stay in the arena. */
+static bool dt_slots_reserve(struct dt_slots *slots, uint32_t count)
 {
-    return strcmp(lhs->name, rhs->name);
+    if (slots->capacity - slots->count >= count)
+        return true;
+
+    uint32_t capacity = slots->capacity ? slots->capacity * 2 : 4;
+    if (capacity < slots->count + count)
+        capacity = slots->count + count;
+
+    struct dt_slot *array = arena_alloc(&dt_arena, capacity * sizeof *array,
+                                        _Alignof(struct dt_slot));
+    if (!array)
+        return false;
+
+    if (slots->count)
+        memcpy(array, slots->slots, slots->count * sizeof *array);
+    slots->slots    = array;
+    slots->capacity = capacity;
+    return true;
 }
 
-int dt_node_cmp(dt_node_t lhs, dt_node_t rhs)
+/*! Adds \p item under \p atom, which must not already be present */
+static bool dt_slots_insert(struct dt_slots *slots, dt_atom_t atom,
+                            void *item)
 {
-    return strcmp(lhs->name, rhs->name);
+    if (!dt_slots_reserve(slots, 1))
+        return false;
+
+    uint32_t i = dt_slots_lower_bound(slots, atom->hash, atom->name);
+
+    memmove(&slots->slots[i + 1], &slots->slots[i],
+            (slots->count - i) * sizeof *slots->slots);
+    slots->slots[i] = (struct dt_slot) { atom->hash, atom->name, item };
+    slots->count++;
+    return true;
+}
+
+static dt_property_t dt_node_add_borrowed(
+    dt_node_t   node,
+    const char *name,
+    const void *value,
+    size_t      len);
+
+static void dt_node_expand_properties(dt_node_t node)
+{
+    if (!node->lazy_properties)
+        return;
+    node->lazy_properties = false;
+
+    uint32_t count = 0;
+    for (int propoff = fdt_first_property_offset(system_fdt, node->fdt_offset);
+             propoff >= 0;
+             propoff = fdt_next_property_offset(system_fdt, propoff))
+        count++;
+    if (!dt_slots_reserve(&node->properties, count))
+        panic("Out of memory expanding \"%s\"", node->name);
+
+    for (int propoff = fdt_first_property_offset(system_fdt, node->fdt_offset);
+             propoff >= 0;
+             propoff = fdt_next_property_offset(system_fdt, propoff)) {
+        int len;
+        const struct fdt_property *fdt_prop =
+            fdt_get_property_by_offset(system_fdt, propoff, &len);
+
+        if (!fdt_prop) {
+            panic("Error getting property of \"%s\": %s\n",
+                node->name, fdt_strerror(len));
+        }
+
+        const char *name = fdt_string(system_fdt,
+                                      fdt32_to_cpu(fdt_prop->nameoff));
+
+        /* The blob stays around for as long as we do */
+        if (!dt_node_add_borrowed(node, name, fdt_prop->data, len))
+            panic("Out of memory allocating \"%s\":\"%s\"",
+                node->name, name);
+    }
 }
 
 dt_node_t dt_node_alloc(dt_node_t parent, const char *name)
 {
-    dt_node_t n = malloc(sizeof *n + strlen(name) + 1);
-    if (!n) return NULL;
+    dt_atom_t atom = dt_intern(name);
+    if (!atom) return NULL;
 
+    dt_node_t n = arena_alloc(&dt_arena, sizeof *n, _Alignof(struct dt_node));
+    if (!n) return NULL;
 
     memset(n, 0, sizeof *n);
-    n->name   = (char*) &n[1];
+    n->name   = atom->name;
     n->parent = parent;
-
-    strcpy((char*)n->name, name);
+    n->fdt_offset = -1;
 
     if (parent) {
-        RB_INSERT(dt_nodes, &parent->children, n);
+        if (dt_slots_find(&parent->children, atom)
+                || !dt_slots_insert(&parent->children, atom, n))
+            return NULL;
+        dt_node_changed(parent);
     }
 
+    if (!dt_node_set_path(n))
+        return NULL;
+
+    dt_node_changed(n);
+    return n;
+}
+
+/*! Allocates a node for the node at \p offset in system_fdt, and adds it to
+ *  \p parent. Its name is borrowed from the blob, and its properties are read
+ *  from there when they are first needed. Its children are not read; they
+ *  are added as they are allocated in turn.
+ */
+dt_node_t dt_node_alloc_fdt(dt_node_t parent, int offset)
+{
+    dt_atom_t atom = dt_intern_name(fdt_get_name(system_fdt, offset, NULL),
+                                    false);
+    if (!atom) return NULL;
+
+    dt_node_t n = arena_alloc(&dt_arena, sizeof *n, _Alignof(struct dt_node));
+    if (!n) return NULL;
+
+    memset(n, 0, sizeof *n);
+    n->name            = atom->name;
+    n->parent          = parent;
+    n->fdt_offset      = offset;
+    n->lazy_properties = true;
+
+    if (parent && !dt_slots_insert(&parent->children, atom, n))
+        return NULL;
+
+    if (!dt_node_set_path(n))
+        return NULL;
+
     return n;
 }
 
+size_t dt_node_child_count(dt_node_t node)
+{
+    return node->children.count;
+}
+
+dt_node_t dt_node_child(dt_node_t node, size_t idx)
+{
+    return idx < node->children.count ? node->children.slots[idx].item : NULL;
+}
+
+size_t dt_node_property_count(dt_node_t node)
+{
+    dt_node_expand_properties(node);
+    return node->properties.count;
+}
+
+dt_property_t dt_node_property(dt_node_t node, size_t idx)
+{
+    dt_node_expand_properties(node);
+    return idx < node->properties.count
+         ? node->properties.slots[idx].item : NULL;
+}
+
+dt_node_t dt_find_node_by_path(const char *path, size_t len)
+{
+    /* Paths are kept without a trailing '/' */
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+
+    struct dt_path_key key = { path, len };
+    struct dt_hash_slot *slot = dt_hash_find(&dt_paths, &key,
+                                             dt_hash_n(path, len));
+    return slot ? (dt_node_t) slot->key : NULL;
+}
+
 dt_node_t dt_node_find_child(dt_node_t parent, const char *name)
 {
-    struct dt_node nd;
-    memset(&nd, 0, sizeof nd);
-    nd.name = name;
-    return RB_FIND(dt_nodes, &parent->children, &nd);
+    /* A name which was never interned can't belong to anything */
+    dt_atom_t atom = dt_atom_lookup(name);
+    return atom ? dt_slots_find(&parent->children, atom) : NULL;
 }
 
 dt_property_t dt_node_find_property(dt_node_t node, const char *name)
 {
-    struct dt_property pr;
-    memset(&pr, 0, sizeof pr);
-    pr.name = name;
-    return RB_FIND(dt_properties, &node->properties, &pr);
+    dt_node_expand_properties(node);
+
+    dt_atom_t atom = dt_atom_lookup(name);
+    return atom ? dt_slots_find(&node->properties, atom) : NULL;
+}
+
+dt_property_t dt_node_find_property_atom(dt_node_t node, dt_atom_t name)
+{
+    dt_node_expand_properties(node);
+    return dt_slots_find(&node->properties, name);
 }
 
 bool dt_node_has_property(dt_node_t node, const char *name)
@@ -68,116 +516,206 @@ const void *dt_node_get_property(dt_node_t node, const char *name)
     } else return NULL;
 }
 
+/*! Drops the decoded reg which property \p p of \p node was used for: that
+ *  of the node for reg, and those of its children for #address-cells and
+ *  #size-cells. Names are interned, so they can be compared as pointers.
+ */
+static void dt_regs_changed(dt_node_t node, dt_property_t p)
+{
+    if (p->name == dt_atom_reg.name) {
+        node->regs_valid = false;
+    } else if (p->name == dt_atom_address_cells.name
+            || p->name == dt_atom_size_cells.name) {
+        for (size_t i = 0; i < dt_node_child_count(node); i++)
+            dt_node_child(node, i)->regs_valid = false;
+    }
+}
+
 dt_property_t dt_node_set_property(
     dt_node_t   node,
     const char *name,
     const void *value,
     size_t      len)
 {
-    dt_property_t p = dt_node_find_property(node, name);
+    dt_atom_t atom = dt_intern(name);
+    if (!atom) return NULL;
+
+    dt_property_t p = dt_node_find_property_atom(node, atom);
     if (!p) {
-        void *vp = malloc(len);
+        void *vp = arena_alloc(&dt_arena, len, sizeof (uint64_t));
         if (!vp) return NULL;
 
-        p = malloc(sizeof(*p) + strlen(name) + 1);
-        if (!p) {
-            free(vp);
-            return NULL;
-        }
+        p = arena_alloc(&dt_arena, sizeof *p, _Alignof(struct dt_property));
+        if (!p) return NULL;
 
         memset(p, 0, sizeof *p);
-        p->name = (char*) &p[1];
-        strcpy((char*) p->name, name);
+        p->name  = atom->name;
         p->value = vp;
+        p->order = node->properties.count;
 
-        RB_INSERT(dt_properties, &node->properties, p);
-    } else if (p->value_len != len) {
-        void *vp = realloc(p->value, len);
+        if (!dt_slots_insert(&node->properties, atom, p))
+            return NULL;
+    } else if (p->borrowed || p->value_len < len) {
+        /* The old value stays in the arena until the tree goes */
+        void *vp = arena_alloc(&dt_arena, len, sizeof (uint64_t));
         if (!vp) return NULL;
-        p->value = vp;
+        p->value    = vp;
+        p->borrowed = false;
     }
 
     p->value_len = len;
     memcpy(p->value, value, len);
+    dt_node_changed(node);
+    dt_regs_changed(node, p);
 
     return p;
 }
 
-bool dt_node_get_reg_range(
-    dt_node_t  node,
-    unsigned   idx,
-    uintptr_t *ptr,
-    size_t    *sz)
+/*! Adds a property without counting it as a change, as when reading the
+ *  node in from system_fdt
+ */
+static dt_property_t dt_node_add_borrowed(
+    dt_node_t   node,
+    const char *name,
+    const void *value,
+    size_t      len)
 {
-    dt_property_t prop = dt_node_find_property(node, "regs");
-    if(!prop)
-        return false;
+    dt_atom_t atom = dt_intern_name(name, false);
+    if (!atom) return NULL;
 
-    uint32_t acells = dt_node_get_address_cells(node->parent);
-    uint32_t scells = dt_node_get_size_cells(node->parent);
-    uint32_t cells  = acells + scells;
+    dt_property_t p = dt_node_find_property_atom(node, atom);
+    if (!p) {
+        p = arena_alloc(&dt_arena, sizeof *p, _Alignof(struct dt_property));
+        if (!p) return NULL;
 
-    unsigned baseIdx = idx * cells;
-    if ((baseIdx + cells) * sizeof(uint32_t) > prop->value_len)
-        return false;
+        memset(p, 0, sizeof *p);
+        p->name  = atom->name;
+        p->order = node->properties.count;
 
-    const uint32_t *p = prop->value;
+        if (!dt_slots_insert(&node->properties, atom, p))
+            return NULL;
+    }
 
-    if (acells == 1) {
-        *ptr = fdt32_to_cpu(p[baseIdx + 0]);
-    } else if (acells == 2) {
-        uint64_t v;
-        memcpy(&v, &p[baseIdx + 0], sizeof v);
-        v = fdt64_to_cpu(v);
+    p->value     = (void*) value;
+    p->value_len = len;
+    p->borrowed  = true;
 
-        if (v > UINTPTR_MAX) {
-            panic("Address out of range (0x%" PRIx64 ") on %s",
-                v, node->name);
-        }
+    return p;
+}
 
-        *ptr = v;
+/*! Like dt_node_set_property, but \p name and \p value are referenced rather
+ *  than copied, and must stay valid for the life of the tree. Setting the
+ *  property later copies it.
+ */
+dt_property_t dt_node_borrow_property(
+    dt_node_t   node,
+    const char *name,
+    const void *value,
+    size_t      len)
+{
+    dt_property_t p = dt_node_add_borrowed(node, name, value, len);
+    if (p) {
+        dt_node_changed(node);
+        dt_regs_changed(node, p);
     }
+    return p;
+}
 
-    if (scells == 1) {
-        *ptr = fdt32_to_cpu(p[acells]);
-    } else if (scells == 2) {
-        uint64_t v;
-        memcpy(&v, &p[baseIdx + 0], sizeof v);
-        v = fdt64_to_cpu(v);
+uint64_t dt_read_cells(const void *cells, unsigned count)
+{
+    if (count > 2)
+        panic("dt: %u cell number", count);
+
+    uint64_t v = 0;
+    for (unsigned i = 0; i < count; i++) {
+        uint32_t cell;
+        memcpy(&cell, (const char *) cells + i * sizeof cell, sizeof cell);
+        v = v << 32 | fdt32_to_cpu(cell);
+    }
+    return v;
+}
+
+const struct dt_reg *dt_node_get_regs(dt_node_t node, unsigned *count)
+{
+    if (node->regs_valid) {
+        *count = node->reg_count;
+        return node->regs;
+    }
 
-        if (v > SIZE_MAX) {
-            panic("Size out of range (0x%" PRIx64 ") on %s",
-                v, node->name);
+    node->reg_count = 0;
+
+    dt_property_t prop = dt_node_find_property_atom(node, &dt_atom_reg);
+    if (prop && node->parent) {
+        uint32_t acells = dt_node_get_address_cells(node->parent);
+        uint32_t scells = dt_node_get_size_cells(node->parent);
+        uint32_t cells  = acells + scells;
+
+        if (!cells || (prop->value_len % (cells * sizeof(uint32_t))) != 0) {
+            panic("dt: node \"%s\": <regs> has size %zu which isn't "
+                "divisible by %" PRIu32 " cells\n", node->name,
+                prop->value_len, cells);
+        }
+
+        uint32_t n = prop->value_len / (sizeof(uint32_t) * cells);
+        if (n > node->reg_capacity) {
+            /* The old array stays in the arena until the tree goes */
+            node->regs = arena_alloc(&dt_arena, n * sizeof *node->regs,
+                                     _Alignof(struct dt_reg));
+            if (!node->regs)
+                panic("Out of memory decoding \"%s\" reg", node->name);
+            node->reg_capacity = n;
         }
 
-        *sz = v;
+        const uint32_t *p = prop->value;
+        for (uint32_t i = 0; i < n; i++, p += cells) {
+            node->regs[i].addr = dt_read_cells(p, acells);
+            node->regs[i].size = dt_read_cells(p + acells, scells);
+        }
+        node->reg_count = n;
     }
 
-    return true;
+    node->regs_valid = true;
+    *count = node->reg_count;
+    return node->regs;
 }
 
-unsigned dt_node_get_reg_count(dt_node_t node)
+bool dt_node_get_reg_range(
+    dt_node_t  node,
+    unsigned   idx,
+    uintptr_t *ptr,
+    size_t    *sz)
 {
-    dt_property_t prop = dt_node_find_property(node, "regs");
-    if(!prop)
+    unsigned count;
+    const struct dt_reg *regs = dt_node_get_regs(node, &count);
+    if (idx >= count)
         return false;
 
-    uint32_t acells = dt_node_get_address_cells(node->parent);
-    uint32_t scells = dt_node_get_size_cells(node->parent);
-    uint32_t cells  = acells + scells;
+    if (regs[idx].addr > UINTPTR_MAX) {
+        panic("Address out of range (0x%" PRIx64 ") on %s",
+            regs[idx].addr, node->name);
+    }
 
-    if ((prop->value_len % (cells * sizeof(uint32_t))) != 0) {
-        panic("dt: node \"%s\": <regs> has size %" PRIu32 " which isn't "
-            "divisible by %" PRIu32 " cells\n", node->name, prop->value_len, cells);
+    if (regs[idx].size > SIZE_MAX) {
+        panic("Size out of range (0x%" PRIx64 ") on %s",
+            regs[idx].size, node->name);
     }
 
-    return prop->value_len / (sizeof(uint32_t) * cells);
+    *ptr = regs[idx].addr;
+    *sz  = regs[idx].size;
+    return true;
+}
+
+unsigned dt_node_get_reg_count(dt_node_t node)
+{
+    unsigned count;
+    dt_node_get_regs(node, &count);
+    return count;
 }
 
 uint32_t dt_node_get_address_cells(dt_node_t node)
 {
     dt_property_t p;
-    if (!(p = dt_node_find_property(node, "#address_cells")))
+    if (!(p = dt_node_find_property_atom(node, &dt_atom_address_cells)))
         panic("Node without address cells");
 
     return dt_property_get_uint32(p);
@@ -186,7 +724,7 @@ uint32_t dt_node_get_address_cells(dt_node_t node)
 uint32_t dt_node_get_size_cells(dt_node_t node)
 {
     dt_property_t p;
-    if (!(p = dt_node_find_property(node, "#size_cells")))
+    if (!(p = dt_node_find_property_atom(node, &dt_atom_size_cells)))
         panic("Node without size cells");
 
     return dt_property_get_uint32(p);
@@ -211,9 +211,10 @@ static gd_device_t arm_pl011_dt_driver_attach(dt_node_t node)
     self->ioctl = arm_pl011_ioctl;
     self->node  = node;
 
+    /* The parent is unbound if no bus driver claimed it */
     gd_device_t parent;
-    if ((rv = gd_device_get_parent(&self->dev, &parent)))
-        goto err0;
+    if ((rv = gd_device_get_parent(&self->dev, &parent)) || !parent)
+        goto err1;
 
     size_t regsz;
     if (gd_bus_get_child_reg_addr(parent, (gd_device_t) self, 0, &self->base, &regsz))
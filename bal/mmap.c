@@ -16,22 +16,48 @@
 
 #include <bal/mmap.h>
 #include <bal/misc.h>
+#include <bal/page_arch.h>
 #include <gd_syscall.h>
-#include <gd_tree.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <inttypes.h>
 
+/* The memory map tree is augmented with the size of the largest run of
+ * conventional memory in each subtree, so that free space can be located
+ * without visiting every entry. The tree code calls this on every node whose
+ * children change.
+ */
+#define RB_AUGMENT(x) mmap_augment(x)
+#include <gd_tree.h>
+
 #if 0
 #define TRACE(...) printf(__VA_ARGS__)
 #else
 #define TRACE(...)
 #endif
 
+/* Define MMAP_DEBUG to 1 to check the memory map after every change. This
+ * walks the whole map each time, so is only for hosted test builds and
+ * debugging.
+ */
+#ifndef MMAP_DEBUG
+#define MMAP_DEBUG 0
+#endif
+
 typedef struct mmap_entry {
     RB_ENTRY(mmap_entry) rbnode;
     gd_memory_map_entry  entry;
+    /*! Size of the largest conventional memory entry in this subtree */
+    uint64_t             max_free;
+    /*! Size of the largest conventional memory entry in this subtree which
+     *  is neither slow nor non-volatile
+     */
+    uint64_t             max_fast;
+    /*! Size of the largest run of such memory in this subtree which can be
+     *  allocated from without breaking up a free large page
+     */
+    uint64_t             max_frag;
 } mmap_entry;
 
 static int mmap_entry_cmp(const mmap_entry *l, const mmap_entry *r)
@@ -43,37 +69,423 @@ static int mmap_entry_cmp(const mmap_entry *l, const mmap_entry *r)
 static RB_HEAD(mmap_tree, mmap_entry) mmap = RB_INITIALIZER(&mmap);
 RB_PROTOTYPE_STATIC(mmap_tree, mmap_entry, rbnode, mmap_entry_cmp)
 
-/* When we free mmap entries, we place them in a linked list built out of their
- * ent->rbnode.rbe_left fields
+static uint64_t mmap_free_size(const mmap_entry *ent)
+{
+    return ent->entry.type == gd_conventional_memory ? ent->entry.size : 0;
+}
+
+/* Memory with these attributes is only allocated when nothing else will do;
+ * it's a poor place for a kernel or its data.
+ */
+#define MMAP_SLOW_ATTRIBUTES (GD_MEMORY_NV | GD_MEMORY_SLOW)
+
+static uint64_t mmap_fast_size(const mmap_entry *ent)
+{
+    return ent->entry.attributes & MMAP_SLOW_ATTRIBUTES ? 0 : mmap_free_size(ent);
+}
+
+/* Large page sizes, largest first. Allocations of at least one of these sizes
+ * are aligned to it where possible, and smaller allocations try not to split
+ * free MMAP_LARGE_PAGE sized blocks.
+ */
+#define MMAP_LARGE_PAGE ((uint64_t) 1 << 21)
+static const uint64_t large_page_sizes[] = { (uint64_t) 1 << 30, MMAP_LARGE_PAGE };
+
+/*! Finds the naturally aligned large pages lying wholly within [\p start,
+ *  \p end). Returns false if there are none, or true if they occupy
+ *  [\p *first, \p *last).
+ */
+static bool mmap_large_pages(uint64_t start, uint64_t end,
+                             uint64_t *first, uint64_t *last)
+{
+    *first = (start + MMAP_LARGE_PAGE - 1) & ~(MMAP_LARGE_PAGE - 1);
+    *last  = end & ~(MMAP_LARGE_PAGE - 1);
+    return *first >= start && *first < *last;
+}
+
+/*! Returns the size of the largest part of \p ent which lies outside of any
+ *  free large page
+ */
+static uint64_t mmap_frag_size(const mmap_entry *ent)
+{
+    if (!mmap_fast_size(ent))
+        return 0;
+
+    uint64_t start = ent->entry.physical_start;
+    uint64_t end   = start + ent->entry.size;
+    uint64_t first, last;
+    if (!mmap_large_pages(start, end, &first, &last))
+        return ent->entry.size;
+
+    return first - start > end - last ? first - start : end - last;
+}
+
+/*! Returns the entry containing \p addr, or the last one before it */
+static mmap_entry *mmap_lookup(uint64_t addr)
+{
+    mmap_entry *ent = RB_ROOT(&mmap), *found = NULL;
+    while (ent) {
+        if (ent->entry.physical_start <= addr) {
+            found = ent;
+            ent = RB_RIGHT(ent, rbnode);
+        } else {
+            ent = RB_LEFT(ent, rbnode);
+        }
+    }
+    return found;
+}
+
+/*! Returns the attributes of the memory at \p addr, so that memory going back
+ *  into the map as conventional memory keeps them
+ */
+static uint64_t mmap_attributes_at(uint64_t addr)
+{
+    mmap_entry *ent = mmap_lookup(addr);
+    if (ent && addr - ent->entry.physical_start < ent->entry.size)
+        return ent->entry.attributes;
+    return 0;
+}
+
+/*! Returns the entry containing \p addr, or NULL if it's in a gap, and sets
+ *  \p piece_end to where that entry or gap ends, or \p end if that's sooner
+ */
+static mmap_entry *mmap_piece(uint64_t addr, uint64_t end,
+                              uint64_t *piece_end)
+{
+    mmap_entry *ent = mmap_lookup(addr);
+    if (ent && addr - ent->entry.physical_start < ent->entry.size) {
+        uint64_t ent_end = ent->entry.physical_start + ent->entry.size;
+        *piece_end = ent_end < end ? ent_end : end;
+        return ent;
+    }
+
+    mmap_entry *next = ent ? RB_NEXT(mmap_tree, &mmap, ent)
+                           : RB_MIN(mmap_tree, &mmap);
+    *piece_end = next && next->entry.physical_start < end
+               ? next->entry.physical_start : end;
+    return NULL;
+}
+
+/*! Recomputes \p ent->max_free, \p ent->max_fast and \p ent->max_frag from
+ *  \p ent and its direct children
+ */
+static void mmap_augment(mmap_entry *ent)
+{
+    mmap_entry *left  = RB_LEFT(ent, rbnode);
+    mmap_entry *right = RB_RIGHT(ent, rbnode);
+    uint64_t max  = mmap_free_size(ent);
+    uint64_t fast = mmap_fast_size(ent);
+    uint64_t frag = mmap_frag_size(ent);
+
+    if (left && left->max_free > max)
+        max = left->max_free;
+    if (right && right->max_free > max)
+        max = right->max_free;
+    if (left && left->max_fast > fast)
+        fast = left->max_fast;
+    if (right && right->max_fast > fast)
+        fast = right->max_fast;
+    if (left && left->max_frag > frag)
+        frag = left->max_frag;
+    if (right && right->max_frag > frag)
+        frag = right->max_frag;
+
+    ent->max_free = max;
+    ent->max_fast = fast;
+    ent->max_frag = frag;
+}
+
+/*! Propagates a change to the type or size of \p ent up to the root */
+static void mmap_update(mmap_entry *ent)
+{
+    for (; ent; ent = RB_PARENT(ent, rbnode))
+        mmap_augment(ent);
+}
+
+#if MMAP_DEBUG
+/*! Checks the subtree maxima of \p ent and its descendants, returning those
+ *  of \p ent
+ */
+static void mmap_check_augment(const mmap_entry *ent, uint64_t *max,
+                               uint64_t *fast, uint64_t *frag)
+{
+    uint64_t m[2] = { 0 }, f[2] = { 0 }, g[2] = { 0 };
+    const mmap_entry *child[2] = {
+        RB_LEFT(ent, rbnode), RB_RIGHT(ent, rbnode)
+    };
+
+    *max  = mmap_free_size(ent);
+    *fast = mmap_fast_size(ent);
+    *frag = mmap_frag_size(ent);
+    for (int i = 0; i < 2; i++) {
+        if (!child[i])
+            continue;
+        if (RB_PARENT(child[i], rbnode) != ent)
+            panic("mmap: bad parent link at %" PRIx64,
+                  child[i]->entry.physical_start);
+
+        mmap_check_augment(child[i], &m[i], &f[i], &g[i]);
+        if (m[i] > *max)  *max  = m[i];
+        if (f[i] > *fast) *fast = f[i];
+        if (g[i] > *frag) *frag = g[i];
+    }
+
+    if (ent->max_free != *max || ent->max_fast != *fast
+            || ent->max_frag != *frag)
+        panic("mmap: stale subtree maximum at %" PRIx64,
+              ent->entry.physical_start);
+}
+
+/*! Panics unless the memory map is sorted, non-overlapping, page aligned and
+ *  merged, and every subtree maximum is up to date
+ */
+static void mmap_check(void)
+{
+    mmap_entry *prev = NULL, *ent;
+    RB_FOREACH(ent, mmap_tree, &mmap) {
+        const gd_memory_map_entry *e = &ent->entry;
+        if (!e->size || (e->physical_start & 0xFFF) || (e->size & 0xFFF))
+            panic("mmap: bad entry %" PRIx64 " + %" PRIx64,
+                  e->physical_start, e->size);
+        if (prev && prev->entry.physical_start + prev->entry.size
+                > e->physical_start)
+            panic("mmap: entries overlap at %" PRIx64, e->physical_start);
+        if (prev && prev->entry.physical_start + prev->entry.size
+                    == e->physical_start
+                && prev->entry.type == e->type
+                && prev->entry.attributes == e->attributes)
+            panic("mmap: unmerged entries at %" PRIx64, e->physical_start);
+        prev = ent;
+    }
+
+    if (RB_ROOT(&mmap)) {
+        uint64_t max, fast, frag;
+        mmap_check_augment(RB_ROOT(&mmap), &max, &fast, &frag);
+    }
+}
+#define MMAP_CHECK() mmap_check()
+#else
+#define MMAP_CHECK()
+#endif
+
+static mmap_entry *mmap_insert(mmap_entry *ent)
+{
+    mmap_entry *old = RB_INSERT(mmap_tree, &mmap, ent);
+    if (!old)
+        mmap_update(ent);
+    return old;
+}
+
+static void mmap_remove(mmap_entry *ent)
+{
+    /* The tree only re-augments the immediate parent of the node which is
+     * unlinked, so find the deepest node whose subtree changes and walk up
+     * from there once the removal is done.
+     */
+    mmap_entry *fixup = RB_PARENT(ent, rbnode);
+    if (RB_LEFT(ent, rbnode) && RB_RIGHT(ent, rbnode)) {
+        mmap_entry *succ = RB_RIGHT(ent, rbnode);
+        while (RB_LEFT(succ, rbnode))
+            succ = RB_LEFT(succ, rbnode);
+        fixup = RB_PARENT(succ, rbnode) == ent ? succ : RB_PARENT(succ, rbnode);
+    }
+
+    RB_REMOVE(mmap_tree, &mmap, ent);
+    mmap_update(fixup);
+}
+
+/* Entries are allocated from slabs. Each slab is a page of conventional memory
+ * taken from the memory map as loader data, and starts with a mmap_slab
+ * header. Free entries within a slab are chained through their
+ * ent->rbnode.rbe_left fields.
  */
-static mmap_entry *last_freed = NULL;
+#define MMAP_SLAB_SIZE 4096
+
+typedef struct mmap_slab mmap_slab;
+struct mmap_slab {
+    /*! Links in the list of slabs with free entries */
+    mmap_slab  *next, *prev;
+    mmap_entry *free;
+    /*! Number of entries handed out from this slab */
+    size_t      used;
+};
+
+#define MMAP_SLAB_ENTRIES \
+    ((MMAP_SLAB_SIZE - sizeof (mmap_slab)) / sizeof (mmap_entry))
 
 /* We pre-allocate 32 mmap entries as empirically sufficient to hold a system
  * memory map. If it isn't, then we will scavenge from that memory map (if you
  * don't have any memory in the first 32 entries we find, WTF is with your
- * system).
+ * system). These are never given back.
  */
 #define MMAP_STATIC_SLOTS 32
-static mmap_entry static_slots[MMAP_STATIC_SLOTS];
-static mmap_entry *alloc_next  = static_slots;
-static size_t      allocatable = MMAP_STATIC_SLOTS;
+static struct {
+    mmap_slab  slab;
+    mmap_entry entries[MMAP_STATIC_SLOTS];
+} static_slab;
+
+/*! Slabs with free entries. Entries are taken from the head; slabs which
+ *  regain a free entry join the tail, so the ones at the head fill up first
+ *  and the others have a chance to empty.
+ */
+static mmap_slab  *slabs_head  = NULL, *slabs_tail = NULL;
+/*! Number of free entries across all slabs */
+static size_t      mmap_nfree  = 0;
 /* incremented each time we update the memory map */
 static size_t      mmap_key     = 0;
 
-static gd_memory_type overlap_precedence[] = {
-    /*! The overlapping region is promoted to the one that comes earlier. */
-    gd_unusable_memory, gd_pal_code, gd_mmio_port_space, gd_mmio,
-    gd_acpi_memory_nvs, gd_runtime_services_code, gd_runtime_services_data,
-    gd_acpi_reclaim_memory, gd_loader_code, gd_loader_data, gd_boot_services_code,
-    gd_boot_services_data, gd_conventional_memory, gd_reserved_memory_type
+/* Runs of free conventional memory known to hold nothing but zeroes, sorted
+ * and disjoint. Forgetting about one is always safe, so when the array is
+ * full new runs just go unrecorded.
+ */
+#define MMAP_MAX_ZERO_RUNS 16
+static struct zero_run {
+    uint64_t start, end;
+} zero_runs[MMAP_MAX_ZERO_RUNS];
+static size_t nzero_runs = 0;
+
+/* Zeroed allocations clear free memory up to a boundary of this size past
+ * what they return, so that the next few small ones find it done already.
+ */
+#define MMAP_ZERO_CHUNK ((uint64_t) 64 << 10)
+
+/* NUMA node ranges, sorted by address and never overlapping. Firmware
+ * describes few enough of these that a fixed array does.
+ */
+#define MMAP_MAX_NODE_RANGES 64
+static gd_memory_node_entry node_ranges[MMAP_MAX_NODE_RANGES];
+static size_t               nnode_ranges = 0;
+
+/*! Number of memory types known to the memory map */
+#define NTYPES (gd_pal_code + 1)
+
+/*! An order of precedence between memory types. Where entries overlap, the
+ *  overlapping region is promoted to the type which comes earlier.
+ */
+struct mmap_policy {
+    /*! Memory types, from highest to lowest precedence */
+    gd_memory_type order[NTYPES];
+    /*! Index of each type in order */
+    uint8_t        rank[NTYPES];
 };
 
+/*! Precedence used when describing the system's memory */
+static const struct mmap_policy insert_policy = {
+    .order = {
+        gd_unusable_memory, gd_pal_code, gd_mmio_port_space, gd_mmio,
+        gd_acpi_memory_nvs, gd_runtime_services_code, gd_runtime_services_data,
+        gd_acpi_reclaim_memory, gd_loader_code, gd_loader_data, gd_boot_services_code,
+        gd_boot_services_data, gd_conventional_memory, gd_reserved_memory_type
+    },
+    .rank = {
+        [gd_unusable_memory]        = 0,  [gd_pal_code]              = 1,
+        [gd_mmio_port_space]        = 2,  [gd_mmio]                  = 3,
+        [gd_acpi_memory_nvs]        = 4,  [gd_runtime_services_code] = 5,
+        [gd_runtime_services_data]  = 6,  [gd_acpi_reclaim_memory]   = 7,
+        [gd_loader_code]            = 8,  [gd_loader_data]           = 9,
+        [gd_boot_services_code]     = 10, [gd_boot_services_data]    = 11,
+        [gd_conventional_memory]    = 12, [gd_reserved_memory_type]  = 13,
+    },
+};
+
+/*! Precedence used when freeing pages. Can free anything apart from unusable
+ *  memory.
+ */
+static const struct mmap_policy free_policy = {
+    .order = {
+        gd_unusable_memory, gd_conventional_memory, gd_pal_code, gd_mmio_port_space, gd_mmio,
+        gd_acpi_memory_nvs, gd_runtime_services_code, gd_runtime_services_data,
+        gd_acpi_reclaim_memory, gd_loader_code, gd_loader_data, gd_boot_services_code,
+        gd_boot_services_data, gd_reserved_memory_type
+    },
+    .rank = {
+        [gd_unusable_memory]        = 0,  [gd_conventional_memory]   = 1,
+        [gd_pal_code]               = 2,  [gd_mmio_port_space]       = 3,
+        [gd_mmio]                   = 4,  [gd_acpi_memory_nvs]       = 5,
+        [gd_runtime_services_code]  = 6,  [gd_runtime_services_data] = 7,
+        [gd_acpi_reclaim_memory]    = 8,  [gd_loader_code]           = 9,
+        [gd_loader_data]            = 10, [gd_boot_services_code]    = 11,
+        [gd_boot_services_data]     = 12, [gd_reserved_memory_type]  = 13,
+    },
+};
+
+/*! Returns the precedence rank of \p type; lower ranks take precedence.
+ *  Unknown types are treated as unusable.
+ */
+static unsigned precedence_rank(const struct mmap_policy *policy,
+                                gd_memory_type type)
+{
+    if ((unsigned) type >= NTYPES)
+        return 0;
+    return policy->rank[type];
+}
+
+
+/*! Returns the slab \p ent was allocated from */
+static mmap_slab *mmap_slab_of(mmap_entry *ent)
+{
+    if (ent >= static_slab.entries && ent < static_slab.entries + MMAP_STATIC_SLOTS)
+        return &static_slab.slab;
+    return (mmap_slab*)((uintptr_t) ent & ~(uintptr_t) (MMAP_SLAB_SIZE - 1));
+}
+
+static void mmap_slab_link(mmap_slab *slab)
+{
+    slab->next = NULL;
+    slab->prev = slabs_tail;
+    if (slabs_tail)
+        slabs_tail->next = slab;
+    else
+        slabs_head = slab;
+    slabs_tail = slab;
+}
+
+static void mmap_slab_unlink(mmap_slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slabs_head = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    else
+        slabs_tail = slab->prev;
+}
+
+/*! Sets up \p slab to hand out the \p count entries at \p entries */
+static void mmap_slab_init(mmap_slab *slab, mmap_entry *entries, size_t count)
+{
+    slab->free = NULL;
+    slab->used = 0;
+    for (size_t i = count; i-- > 0;) {
+        entries[i].rbnode.rbe_left = slab->free;
+        slab->free = &entries[i];
+    }
+
+    mmap_slab_link(slab);
+    mmap_nfree += count;
+}
+
+/*! Makes the static slab available on first use. A slab with neither free
+ *  nor used entries has never been set up.
+ */
+static void mmap_pool_init(void)
+{
+    if (!static_slab.slab.free && !static_slab.slab.used)
+        mmap_slab_init(&static_slab.slab, static_slab.entries, MMAP_STATIC_SLOTS);
+}
 
 static void mmap_free_entry(mmap_entry *ent)
 {
-    ent->rbnode.rbe_left  = last_freed;
+    mmap_slab *slab = mmap_slab_of(ent);
+
+    ent->rbnode.rbe_left  = slab->free;
     ent->rbnode.rbe_right = ent->rbnode.rbe_parent = NULL;
-    last_freed = ent;
+    if (!slab->free)
+        mmap_slab_link(slab);
+    slab->free = ent;
+    mmap_nfree++;
+    slab->used--;
 }
 
 static void merge_adjacent(mmap_entry *middle)
@@ -81,286 +493,703 @@ static void merge_adjacent(mmap_entry *middle)
     mmap_entry *prev = RB_PREV(mmap_tree, &mmap, middle);
     mmap_entry *next = RB_NEXT(mmap_tree, &mmap, middle);
 
-    /* TODO: attributes */
     if (prev && prev->entry.type == middle->entry.type
+            && prev->entry.attributes == middle->entry.attributes
             && prev->entry.physical_start + prev->entry.size
                 == middle->entry.physical_start) {
         prev->entry.size += middle->entry.size;
-        RB_REMOVE(mmap_tree, &mmap, middle);
+        mmap_remove(middle);
         mmap_free_entry(middle);
+        mmap_update(prev);
         ++mmap_key;
         middle = prev;
     }
 
     if (next && middle->entry.type == next->entry.type
+            && middle->entry.attributes == next->entry.attributes
             && middle->entry.physical_start + middle->entry.size
                 == next->entry.physical_start) {
         middle->entry.size += next->entry.size;
-        RB_REMOVE(mmap_tree, &mmap, next);
+        mmap_remove(next);
         mmap_free_entry(next);
+        mmap_update(middle);
         ++mmap_key;
     }
 }
 
-static mmap_entry *mmap_alloc_entry(void)
+/*! Returns the type with higher precedence. */
+static gd_memory_type higher_precedence(const struct mmap_policy *policy,
+                                        gd_memory_type a, gd_memory_type b)
 {
-    mmap_entry *mme = NULL;
-    if (last_freed) {
-        mme = last_freed;
-        last_freed = last_freed->rbnode.rbe_left;
-        return mme;
-    } else {
-        if (!allocatable) {
-            RB_FOREACH (mme, mmap_tree, &mmap) {
-                if (mme->entry.physical_start + 4096 > UINTPTR_MAX)
-                    break;
-
-                if (mme->entry.type == gd_conventional_memory) {
-                    mmap_entry *neighbour;
-                    if (mme->entry.size == 4096) {
-                        alloc_next  = (mmap_entry*)(uintptr_t) mme->entry.physical_start;
-                        allocatable = 4096 / sizeof(*mme);
-
-                        mme->entry.type = gd_loader_data;
-                        merge_adjacent(mme);
-                    } else if ((neighbour = RB_PREV(mmap_tree, &mmap, mme))
-                            && neighbour->entry.type == gd_loader_data
-                            && (neighbour->entry.physical_start + neighbour->entry.size)
-                                == mme->entry.physical_start) {
-                        // slice out first 4kiB
-
-                        alloc_next  = (mmap_entry*)(uintptr_t) mme->entry.physical_start;
-                        allocatable = 4096 / sizeof(*mme);
-
-                        neighbour->entry.size += 4096;
-                        mme->entry.size -= 4096;
-                        mme->entry.physical_start += 4096;
-                    } else if ((neighbour = RB_NEXT(mmap_tree, &mmap, mme))
-                            && neighbour->entry.type == gd_loader_data
-                            && (mme->entry.physical_start + mme->entry.size)
-                                == neighbour->entry.physical_start) {
-
-                        if (mme->entry.physical_start + mme->entry.size > UINTPTR_MAX)
-                            break;
-
-                        // slice out last 4kB
-                        neighbour->entry.size += 4096;
-                        neighbour->entry.physical_start -= 4096;
-                        mme->entry.size -= 4096;
-
-                        alloc_next  = (mmap_entry*)(uintptr_t) neighbour->entry.physical_start;
-                        allocatable = 4096 / sizeof(*mme);
-                    } else {
-                        // neither neigbour is appropriate
-                        alloc_next  = (mmap_entry*)(uintptr_t) mme->entry.physical_start;
-                        allocatable = 4096 / sizeof(*mme) - 1;
-                        alloc_next->entry.type = gd_loader_data;
-                        alloc_next->entry.physical_start = mme->entry.physical_start;
-                        alloc_next->entry.size = 4096;
-                        alloc_next->entry.attributes = mme->entry.attributes;
-
-                        mme->entry.physical_start += 4096;
-                        mme->entry.size -= 4096;
-
-                        RB_INSERT(mmap_tree, &mmap, alloc_next);
-                        alloc_next += 1;
-                    }
-                    ++mmap_key;
-                    break;
-                }
-            }
-
-            if (!allocatable) {
-                // Didn't manage to grab any space. Panic!
-                panic("Out of memory");
-            }
-        }
-        mme = alloc_next;
-        alloc_next += 1;
-        allocatable--;
-        return mme;
-    }
+    unsigned ra = precedence_rank(policy, a);
+    unsigned rb = precedence_rank(policy, b);
+    return policy->order[ra < rb ? ra : rb];
 }
 
-/*! Returns the type with higher precedence. */
-static gd_memory_type higher_precedence(gd_memory_type a, gd_memory_type b)
+/*! Returns the attributes of memory described by both \p a and \p b. Only
+ *  the entry whose type takes precedence counts; where the two are of equal
+ *  rank, their attributes are combined.
+ */
+static uint64_t overlap_attributes(const struct mmap_policy *policy,
+                                   const gd_memory_map_entry *a,
+                                   const gd_memory_map_entry *b)
 {
-    for (size_t i = 0; i < sizeof overlap_precedence/sizeof (gd_memory_type); i++)
-    {
-        if (overlap_precedence[i] == a)
-            return a;
-        else if (overlap_precedence[i] == b)
-            return b;
-    }
-
-    // Unusable.
-    return gd_unusable_memory;
+    unsigned ra = precedence_rank(policy, a->type);
+    unsigned rb = precedence_rank(policy, b->type);
+    if (ra == rb)
+        return a->attributes | b->attributes;
+    return ra < rb ? a->attributes : b->attributes;
 }
 
-/* Fixes overlap bewteen \p first and the following node */
-static void fix_overlap(mmap_entry *first)
+static void mmap_insert_entry(const struct mmap_policy *policy,
+                              gd_memory_map_entry entry);
+
+/* Fixes overlap bewteen \p first and the following node. The overlapping
+ * part becomes the following node, and whatever sticks out beyond it is added
+ * afresh with the type and attributes of the entry it came from.
+ */
+static void fix_overlap(const struct mmap_policy *policy, mmap_entry *first)
 {
     if (!first) return;
     mmap_entry *second = RB_NEXT(mmap_tree, &mmap, first);
-    gd_memory_map_entry new_entry = { 0 };
     if (!second) return;
 
-    if ((first->entry.physical_start + first->entry.size)
-            <= second->entry.physical_start)
-        return;
-
-    gd_memory_type type = higher_precedence(first->entry.type, second->entry.type);
     uint64_t first_physical_end = first->entry.physical_start + first->entry.size;
     uint64_t second_physical_end = second->entry.physical_start + second->entry.size;
+    if (first_physical_end <= second->entry.physical_start)
+        return;
 
-    if (first_physical_end < second_physical_end) {
+    gd_memory_map_entry rest = { 0 };
+    if (first_physical_end > second_physical_end) {
+        // Second entry is a subset
+        rest = first->entry;
+        rest.physical_start = second_physical_end;
+        rest.size = first_physical_end - second_physical_end;
+    } else if (first_physical_end < second_physical_end) {
         // Partition
-        type = higher_precedence(first->entry.type, second->entry.type);
+        rest = second->entry;
+        rest.physical_start = first_physical_end;
+        rest.size = second_physical_end - first_physical_end;
+    }
 
-        if (type == first->entry.type) {
-            second->entry.size = second_physical_end - first_physical_end;
-            second->entry.physical_start = second_physical_end - second->entry.size;
-            return;
-        } else if (type == second->entry.type) {
-            first->entry.size = second->entry.physical_start - first->entry.physical_start;
-            return;
-        }
+    second->entry.attributes = overlap_attributes(policy, &first->entry,
+                                                  &second->entry);
+    second->entry.type = higher_precedence(policy, first->entry.type,
+                                           second->entry.type);
+    if (rest.size)
+        second->entry.size = rest.physical_start - second->entry.physical_start;
+    first->entry.size = second->entry.physical_start - first->entry.physical_start;
+    mmap_update(second);
+    mmap_update(first);
 
-        new_entry.physical_start = first_physical_end;
-        new_entry.size = second_physical_end - first_physical_end;
-        new_entry.type = type;
-        new_entry.attributes = second->entry.attributes;
-    } else if (first_physical_end > second_physical_end) {
-        // Second entry is a subset
+    if (rest.size)
+        mmap_insert_entry(policy, rest);
 
-        if (type == first->entry.type) {
-            // Redundant second entry.
-            RB_REMOVE(mmap_tree, &mmap, second);
-            mmap_free_entry(second);
+    /* The overlap may well be the same as either side of it */
+    merge_adjacent(second);
+}
 
-            fix_overlap(first);
-            return;
-        }
+/*! A request for a run of pages, as validated by gd_alloc_pages_constrained */
+struct alloc_request {
+    uint64_t size;
+    uint64_t align;
+    /*! Lowest and highest permissible start addresses */
+    uint64_t min_start, max_start;
+    bool     top_down;
+    /*! Only allocate from memory which is neither slow nor non-volatile */
+    bool     fast_only;
+    /*! Only allocate from parts of such runs outside of free large pages */
+    bool     fragments_only;
+};
 
-        new_entry.physical_start = second_physical_end;
-        new_entry.size = first_physical_end - second_physical_end;
-        new_entry.type = first->entry.type;
-        new_entry.attributes = first->entry.attributes;
+/*! Checks whether [\p start, \p end) can satisfy \p req and, if so,
+ *  returns the address to allocate from in \p *paddr
+ */
+static bool mmap_fit_range(uint64_t start, uint64_t end,
+                           const struct alloc_request *req, uint64_t *paddr)
+{
+    if (end - start < req->size)
+        return false;
+
+    uint64_t lo = start;
+    uint64_t hi = end - req->size;
+    if (lo < req->min_start)
+        lo = req->min_start;
+    if (hi > req->max_start)
+        hi = req->max_start;
+    if (lo > hi)
+        return false;
+
+    uint64_t addr;
+    if (req->top_down) {
+        addr = hi & ~(req->align - 1);
+        if (addr < lo)
+            return false;
     } else {
-        // Second entry is end of first
-        second->entry.type = type;
-        first->entry.size = second->entry.physical_start - first->entry.physical_start;
-        return;
+        addr = (lo + req->align - 1) & ~(req->align - 1);
+        if (addr < lo || addr > hi)
+            return false;
     }
 
-    second->entry.attributes = first->entry.attributes | second->entry.attributes;
-    second->entry.type = type;
-    second->entry.size = new_entry.physical_start - second->entry.physical_start;
-    first->entry.size = second->entry.physical_start - first->entry.physical_start;
+    *paddr = addr;
+    return true;
+}
 
-    mmap_add_entry(new_entry);
-    return;
+/*! Checks whether \p ent can satisfy \p req and, if so, returns the address
+ *  to allocate from in \p *paddr
+ */
+static bool mmap_fit(const mmap_entry *ent, const struct alloc_request *req,
+                     uint64_t *paddr)
+{
+    if ((req->fast_only ? mmap_fast_size(ent) : mmap_free_size(ent)) < req->size)
+        return false;
+
+    uint64_t start = ent->entry.physical_start;
+    uint64_t end   = start + ent->entry.size;
+    uint64_t first, last;
+
+    if (req->fragments_only && mmap_large_pages(start, end, &first, &last)) {
+        if (req->top_down)
+            return mmap_fit_range(last, end, req, paddr)
+                || mmap_fit_range(start, first, req, paddr);
+        else
+            return mmap_fit_range(start, first, req, paddr)
+                || mmap_fit_range(last, end, req, paddr);
+    }
+
+    return mmap_fit_range(start, end, req, paddr);
 }
 
-int gd_alloc_pages(gd_memory_type type, void **presult, size_t count)
+/*! Finds the lowest (or, for top down requests, highest) addressed entry in
+ *  the subtree rooted at \p ent which can satisfy \p req. Subtrees without a
+ *  large enough run or lying wholly outside the permitted address range are
+ *  never entered.
+ */
+static mmap_entry *mmap_find_constrained(mmap_entry *ent,
+                                         const struct alloc_request *req,
+                                         uint64_t *paddr)
 {
-    if (!count)
-        return 0;
+    if (!ent)
+        return NULL;
+
+    uint64_t max = req->fragments_only ? ent->max_frag
+                 : req->fast_only      ? ent->max_fast
+                 :                       ent->max_free;
+    if (max < req->size)
+        return NULL;
+
+    /* Everything to our left ends at or below our start; everything to our
+     * right starts above it */
+    mmap_entry *left  = ent->entry.physical_start > req->min_start
+                      ? RB_LEFT(ent, rbnode)  : NULL;
+    mmap_entry *right = ent->entry.physical_start < req->max_start
+                      ? RB_RIGHT(ent, rbnode) : NULL;
+    mmap_entry *found;
+
+    if ((found = mmap_find_constrained(req->top_down ? right : left, req, paddr)))
+        return found;
+
+    if (mmap_fit(ent, req, paddr))
+        return ent;
+
+    return mmap_find_constrained(req->top_down ? left : right, req, paddr);
+}
 
-    TRACE("Attempt to alloc %ul pages \n", count);
-    mmap_entry *mme = NULL;
-    RB_FOREACH (mme, mmap_tree, &mmap) {
-        TRACE("Try %" PRIx64 " type %d.. ", mme->entry.physical_start, mme->entry.type);
-        if (mme->entry.physical_start + count * 4096 > UINTPTR_MAX) {
-            TRACE("Address space limit\n");
+/*! Finds a run to satisfy \p req, preferring placements which keep large
+ *  pages intact. Requests of a large page or more are first tried aligned to
+ *  it; smaller requests are first steered into memory which is already too
+ *  fragmented to hold one. Slow and non-volatile memory is used last.
+ */
+static mmap_entry *mmap_find_run(struct alloc_request *req, uint64_t *paddr)
+{
+    mmap_entry *root = RB_ROOT(&mmap);
+    mmap_entry *found;
+
+    req->fast_only = true;
+    if (req->size < MMAP_LARGE_PAGE) {
+        req->fragments_only = true;
+        found = mmap_find_constrained(root, req, paddr);
+        req->fragments_only = false;
+        if (found)
+            return found;
+    }
+
+    uint64_t align = req->align;
+    for (size_t i = 0; i < sizeof large_page_sizes / sizeof (uint64_t); i++) {
+        if (req->size < large_page_sizes[i] || align >= large_page_sizes[i])
+            continue;
+
+        req->align = large_page_sizes[i];
+        found = mmap_find_constrained(root, req, paddr);
+        req->align = align;
+        if (found)
+            return found;
+    }
+
+    found = mmap_find_constrained(root, req, paddr);
+    req->fast_only = false;
+    if (found)
+        return found;
+
+    return mmap_find_constrained(root, req, paddr);
+}
+
+static void zero_run_remove(size_t i)
+{
+    nzero_runs--;
+    memmove(&zero_runs[i], &zero_runs[i + 1],
+            (nzero_runs - i) * sizeof *zero_runs);
+}
+
+/*! Stops treating [\p start, \p end) as known to be zero */
+static void zero_runs_forget(uint64_t start, uint64_t end)
+{
+    size_t i = 0;
+    while (i < nzero_runs) {
+        struct zero_run *run = &zero_runs[i];
+
+        if (run->end <= start) {
+            i++;
+        } else if (run->start >= end) {
+            break;
+        } else if (run->start < start && run->end > end) {
+            /* If there is no room to split the run, keep the head */
+            if (nzero_runs < MMAP_MAX_ZERO_RUNS) {
+                memmove(&zero_runs[i + 2], &zero_runs[i + 1],
+                        (nzero_runs - i - 1) * sizeof *zero_runs);
+                zero_runs[i + 1] = (struct zero_run) { end, run->end };
+                nzero_runs++;
+            }
+            run->end = start;
             break;
+        } else if (run->start < start) {
+            run->end = start;
+            i++;
+        } else if (run->end > end) {
+            run->start = end;
+            break;
+        } else {
+            zero_run_remove(i);
         }
+    }
+}
 
-        if (mme->entry.type == gd_conventional_memory
-            && mme->entry.size >= count * 4096) {
-            mmap_entry *neighbour;
+/*! Records that free memory [\p start, \p end) holds only zeroes */
+static void zero_runs_note(uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return;
+    zero_runs_forget(start, end);
 
-            if (mme->entry.size == count * 4096) {
-                mme->entry.type = type;
-                *presult  = (void*)(uintptr_t) mme->entry.physical_start;
+    size_t i = 0;
+    while (i < nzero_runs && zero_runs[i].end < start)
+        i++;
 
-                merge_adjacent(mme);
-            } else if ((neighbour = RB_PREV(mmap_tree, &mmap, mme))
-                    && neighbour->entry.type == type
-                    && (neighbour->entry.physical_start + neighbour->entry.size)
-                        == mme->entry.physical_start) {
-                // slice out first `count` pages.
+    if (i < nzero_runs && zero_runs[i].end == start) {
+        zero_runs[i].end = end;
+        if (i + 1 < nzero_runs && zero_runs[i + 1].start == end) {
+            zero_runs[i].end = zero_runs[i + 1].end;
+            zero_run_remove(i + 1);
+        }
+    } else if (i < nzero_runs && zero_runs[i].start == end) {
+        zero_runs[i].start = start;
+    } else if (nzero_runs < MMAP_MAX_ZERO_RUNS) {
+        memmove(&zero_runs[i + 1], &zero_runs[i],
+                (nzero_runs - i) * sizeof *zero_runs);
+        zero_runs[i] = (struct zero_run) { start, end };
+        nzero_runs++;
+    }
+}
 
-                *presult  = (void*)(uintptr_t) mme->entry.physical_start;
+/*! Zeroes whatever parts of [\p start, \p end) aren't known to be zero */
+static void mmap_zero(uint64_t start, uint64_t end)
+{
+    for (size_t i = 0; i < nzero_runs && start < end; i++) {
+        const struct zero_run *run = &zero_runs[i];
+        if (run->end <= start)
+            continue;
+        if (run->start >= end)
+            break;
 
-                neighbour->entry.size += count * 4096;
-                mme->entry.size -= count * 4096;
-                mme->entry.physical_start += count * 4096;
-            } else if ((neighbour = RB_NEXT(mmap_tree, &mmap, mme))
-                    && neighbour->entry.type == type
-                    && (mme->entry.physical_start + mme->entry.size)
-                        == neighbour->entry.physical_start) {
+        if (run->start > start)
+            page_zero((void*)(uintptr_t) start, run->start - start);
+        start = run->end;
+    }
 
-                if (mme->entry.physical_start + mme->entry.size > UINTPTR_MAX)
-                    break;
+    if (start < end)
+        page_zero((void*)(uintptr_t) start, end - start);
+}
 
-                // slice out last `count` pages.
-                neighbour->entry.size += count * 4096;
-                neighbour->entry.physical_start -= count * 4096;
-                mme->entry.size -= count * 4096;
+/*! Zeroes [\p start, \p start + \p size) within the conventional memory
+ *  entry \p mme, which is about to be allocated. The free memory beyond it,
+ *  in the direction the next allocation is likely to come from, is zeroed up
+ *  to a chunk boundary and remembered.
+ */
+static void mmap_zero_alloc(const mmap_entry *mme, uint64_t start,
+                            uint64_t size, bool top_down)
+{
+    uint64_t end = start + size;
+    uint64_t ahead_start, ahead_end;
+
+    if (top_down) {
+        ahead_start = start & ~(MMAP_ZERO_CHUNK - 1);
+        ahead_end   = start;
+        if (ahead_start < mme->entry.physical_start)
+            ahead_start = mme->entry.physical_start;
+    } else {
+        ahead_start = end;
+        ahead_end   = (end + MMAP_ZERO_CHUNK - 1) & ~(MMAP_ZERO_CHUNK - 1);
+        if (ahead_end > mme->entry.physical_start + mme->entry.size
+                || ahead_end < end)
+            ahead_end = mme->entry.physical_start + mme->entry.size;
+    }
 
-                *presult  = (void*)(uintptr_t) neighbour->entry.physical_start;
-            } else {
-                // neither neigbour is appropriate
-                *presult  = (void*)(uintptr_t) mme->entry.physical_start;
+    mmap_zero(top_down ? ahead_start : start, top_down ? end : ahead_end);
+    zero_runs_note(ahead_start, ahead_end);
+}
 
-                mmap_entry *new_entry = mmap_alloc_entry();
-                new_entry->entry.type = type;
-                new_entry->entry.physical_start = mme->entry.physical_start;
-                new_entry->entry.size = count * 4096;
-                new_entry->entry.attributes = mme->entry.attributes;
+/*! Changes the type of [\p start, \p start + \p size), which lies within the
+ *  conventional memory entry \p mme, to \p type. Up to two entries from
+ *  \p spare are consumed; those that are consumed are set to NULL.
+ */
+static void mmap_carve(mmap_entry *mme, uint64_t start, uint64_t size,
+                       gd_memory_type type, mmap_entry *spare[2])
+{
+    uint64_t end = mme->entry.physical_start + mme->entry.size;
+    mmap_entry *alloc = mme;
 
-                mme->entry.physical_start += count * 4096;
-                mme->entry.size -= count * 4096;
+    if (start > mme->entry.physical_start) {
+        alloc = spare[0];
+        spare[0] = NULL;
 
-                RB_INSERT(mmap_tree, &mmap, new_entry);
-            }
+        alloc->entry = mme->entry;
+        alloc->entry.physical_start = start;
 
-            ++mmap_key;
-            return 0;
-        } else {
-            TRACE("Wrong type or too small\n");
+        mme->entry.size = start - mme->entry.physical_start;
+        mmap_update(mme);
+    }
+
+    if (start + size < end) {
+        mmap_entry *tail = spare[1];
+        spare[1] = NULL;
+
+        tail->entry = mme->entry;
+        tail->entry.physical_start = start + size;
+        tail->entry.size = end - (start + size);
+        mmap_insert(tail);
+    }
+
+    zero_runs_forget(start, start + size);
+
+    alloc->entry.type = type;
+    alloc->entry.size = size;
+    if (alloc == mme)
+        mmap_update(alloc);
+    else
+        mmap_insert(alloc);
+
+    merge_adjacent(alloc);
+    ++mmap_key;
+}
+
+/*! Takes a free entry, without touching the memory map. Returns NULL if
+ *  there are none left.
+ */
+static mmap_entry *mmap_take_entry(void)
+{
+    mmap_pool_init();
+
+    mmap_slab *slab = slabs_head;
+    if (!slab)
+        return NULL;
+
+    mmap_entry *mme = slab->free;
+    slab->free = mme->rbnode.rbe_left;
+    if (!slab->free)
+        mmap_slab_unlink(slab);
+    mmap_nfree--;
+    slab->used++;
+    return mme;
+}
+
+/*! Takes a page of conventional memory out of the memory map to hold more
+ *  entries. This is the only place slabs come from.
+ */
+static bool mmap_grow_entries(void)
+{
+    struct alloc_request req = {
+        .size      = MMAP_SLAB_SIZE,
+        .align     = MMAP_SLAB_SIZE,
+        .min_start = 0,
+        .max_start = (uint64_t) UINTPTR_MAX - (MMAP_SLAB_SIZE - 1),
+        .top_down  = false,
+    };
+    uint64_t addr;
+
+    mmap_entry *mme = mmap_find_run(&req, &addr);
+    if (!mme)
+        return false;
+
+    /* The page is free memory, so it can supply the entries needed to
+     * carve it out of the map.
+     */
+    mmap_slab *slab = (mmap_slab*)(uintptr_t) addr;
+    mmap_slab_init(slab, (mmap_entry*)(slab + 1), MMAP_SLAB_ENTRIES);
+
+    mmap_entry *spare[2] = { mmap_take_entry(), mmap_take_entry() };
+    mmap_carve(mme, addr, MMAP_SLAB_SIZE, gd_loader_data, spare);
+    if (spare[0])
+        mmap_free_entry(spare[0]);
+    if (spare[1])
+        mmap_free_entry(spare[1]);
+    return true;
+}
+
+/* The most entries adding one range to the map can use: the range itself
+ * and the partial pages at either end can each split an entry at both ends,
+ * and one more is held while overlaps are resolved.
+ */
+#define MMAP_INSERT_ENTRIES 8
+
+/*! Makes sure at least \p count entries are free, taking pages out of the
+ *  memory map for more if need be. Returns false if there's no memory left
+ *  to hold them. Called before changing the map, so that running out never
+ *  leaves it half changed.
+ */
+static bool mmap_reserve_entries(size_t count)
+{
+    mmap_pool_init();
+    while (mmap_nfree < count) {
+        if (!mmap_grow_entries())
+            return false;
+    }
+    return true;
+}
+
+/*! Takes one of the entries reserved by mmap_reserve_entries */
+static mmap_entry *mmap_alloc_entry(void)
+{
+    mmap_entry *mme = mmap_take_entry();
+    if (!mme)
+        panic("Out of memory");
+    return mme;
+}
+
+/*! Moves the tree node \p from to \p to */
+static void mmap_move_entry(mmap_entry *from, mmap_entry *to)
+{
+    *to = *from;
+
+    mmap_entry *parent = RB_PARENT(to, rbnode);
+    if (!parent)
+        RB_ROOT(&mmap) = to;
+    else if (RB_LEFT(parent, rbnode) == from)
+        RB_LEFT(parent, rbnode) = to;
+    else
+        RB_RIGHT(parent, rbnode) = to;
+
+    if (RB_LEFT(to, rbnode))
+        RB_PARENT(RB_LEFT(to, rbnode), rbnode) = to;
+    if (RB_RIGHT(to, rbnode))
+        RB_PARENT(RB_RIGHT(to, rbnode), rbnode) = to;
+}
+
+/*! Gives slabs back to the memory map once there are enough free entries
+ *  elsewhere to hold what they contain. The least used slab goes first; its
+ *  entries are moved out before the page is freed. A slab's worth of free
+ *  entries is always kept in hand, so that we don't immediately have to take
+ *  a page again.
+ */
+static void mmap_reclaim(void)
+{
+    while (mmap_nfree >= 2 * MMAP_SLAB_ENTRIES) {
+        mmap_slab *victim = NULL;
+        for (mmap_slab *slab = slabs_head; slab; slab = slab->next) {
+            if (slab != &static_slab.slab && (!victim || slab->used < victim->used))
+                victim = slab;
+        }
+        if (!victim)
+            return;
+
+        size_t victim_free = MMAP_SLAB_ENTRIES - victim->used;
+        if (mmap_nfree - victim_free < victim->used + MMAP_SLAB_ENTRIES)
+            return;
+
+        mmap_slab_unlink(victim);
+        mmap_nfree -= victim_free;
+
+        mmap_entry *ent = RB_MIN(mmap_tree, &mmap);
+        while (victim->used) {
+            if (mmap_slab_of(ent) == victim) {
+                mmap_entry *to = mmap_take_entry();
+                mmap_move_entry(ent, to);
+                victim->used--;
+                ent = to;
+            }
+            ent = RB_NEXT(mmap_tree, &mmap, ent);
         }
+
+        gd_memory_map_entry page = {
+            .physical_start = (uintptr_t) victim,
+            .size = MMAP_SLAB_SIZE,
+            .type = gd_conventional_memory,
+            .attributes = mmap_attributes_at((uintptr_t) victim)
+        };
+        mmap_insert_entry(&free_policy, page);
+    }
+}
+
+/*! Finds a run to satisfy \p req within proximity domain \p domain */
+static mmap_entry *mmap_find_on_node(const struct alloc_request *req,
+                                     uint32_t domain, uint64_t *paddr)
+{
+    for (size_t n = 0; n < nnode_ranges; n++) {
+        const gd_memory_node_entry *range =
+            &node_ranges[req->top_down ? nnode_ranges - n - 1 : n];
+        if (range->proximity_domain != domain || range->size < req->size)
+            continue;
+
+        struct alloc_request local = *req;
+        uint64_t last = range->physical_start + (range->size - req->size);
+        if (local.min_start < range->physical_start)
+            local.min_start = range->physical_start;
+        if (local.max_start > last)
+            local.max_start = last;
+        if (local.min_start > local.max_start)
+            continue;
+
+        mmap_entry *found = mmap_find_run(&local, paddr);
+        if (found)
+            return found;
     }
 
-    return ENOMEM;
+    return NULL;
 }
 
-int gd_free_pages(void *start_address, size_t count)
+int gd_alloc_pages_constrained(
+    gd_memory_type type,
+    void         **presult,
+    size_t         count,
+    uint64_t       alignment,
+    uint64_t       min_address,
+    uint64_t       max_address,
+    unsigned       flags)
 {
-    /* Can free anything apart from unusable memory. */
-    gd_memory_type free_overlap_precedence[] = {
-        gd_unusable_memory, gd_conventional_memory, gd_pal_code, gd_mmio_port_space, gd_mmio,
-        gd_acpi_memory_nvs, gd_runtime_services_code, gd_runtime_services_data,
-        gd_acpi_reclaim_memory, gd_loader_code, gd_loader_data, gd_boot_services_code,
-        gd_boot_services_data, gd_reserved_memory_type
-    }, temp[sizeof overlap_precedence / sizeof (gd_memory_type)];
+    if (!count)
+        return 0;
 
-    gd_memory_map_entry free = {
-        .physical_start = (uintptr_t) start_address,
-        .size = count * 4096,
-        .type = gd_conventional_memory
+    if (alignment & (alignment - 1))
+        return EINVAL;
+    if (alignment < 4096)
+        alignment = 4096;
+    if (max_address > UINTPTR_MAX)
+        max_address = UINTPTR_MAX;
+
+    struct alloc_request req = {
+        .size      = (uint64_t) count * 4096,
+        .align     = alignment,
+        .min_start = min_address,
+        .top_down  = !(flags & GD_ALLOC_BOTTOM_UP),
     };
 
-    memcpy(&temp, &overlap_precedence, sizeof overlap_precedence);
-    memcpy(&overlap_precedence, &free_overlap_precedence, sizeof free_overlap_precedence);
-    mmap_add_entry(free);
-    memcpy(&overlap_precedence, &temp, sizeof overlap_precedence);
+    if (max_address < min_address || max_address - min_address < req.size - 1)
+        return ENOMEM;
+    req.max_start = max_address - (req.size - 1);
+
+    TRACE("Attempt to alloc %zu pages \n", count);
 
+    /* Obtaining entries may carve pages out of the memory map, so do it
+     * before choosing the run we allocate from. Those that go unused are
+     * returned to the free list.
+     */
+    if (!mmap_reserve_entries(2))
+        return ENOMEM;
+    mmap_entry *spare[2] = { mmap_alloc_entry(), mmap_alloc_entry() };
+    uint64_t addr = 0;
+
+    mmap_entry *mme = NULL;
+    if (GD_ALLOC_HAS_NODE(flags))
+        mme = mmap_find_on_node(&req, GD_ALLOC_NODE_OF(flags), &addr);
+    if (!mme && !(GD_ALLOC_HAS_NODE(flags) && (flags & GD_ALLOC_NODE_STRICT)))
+        mme = mmap_find_run(&req, &addr);
+    if (mme) {
+        TRACE("Using %" PRIx64 "\n", addr);
+        if (flags & GD_ALLOC_ZEROED)
+            mmap_zero_alloc(mme, addr, req.size, req.top_down);
+        mmap_carve(mme, addr, req.size, type, spare);
+        *presult = (void*)(uintptr_t) addr;
+    } else {
+        TRACE("No suitable run\n");
+    }
+
+    if (spare[0])
+        mmap_free_entry(spare[0]);
+    if (spare[1])
+        mmap_free_entry(spare[1]);
+
+    MMAP_CHECK();
+    return mme ? 0 : ENOMEM;
+}
+
+int gd_alloc_pages(gd_memory_type type, void **presult, size_t count)
+{
+    return gd_alloc_pages_constrained(type, presult, count, 4096,
+        0, UINTPTR_MAX, GD_ALLOC_BOTTOM_UP);
+}
+
+int gd_free_pages(void *start_address, size_t count)
+{
+    uint64_t start = (uintptr_t) start_address;
+    uint64_t end   = start + (uint64_t) count * 4096;
+    uint64_t next;
+
+    /* The pages go back a piece at a time, each keeping the attributes of
+     * the entry it was in. Only the pieces at either end can split an
+     * entry, but each gap in the map needs one of its own.
+     */
+    size_t gaps = 0;
+    for (uint64_t pos = start; pos < end; pos = next) {
+        if (!mmap_piece(pos, end, &next))
+            gaps++;
+    }
+    if (!mmap_reserve_entries(MMAP_INSERT_ENTRIES + gaps))
+        return ENOMEM;
+
+    for (uint64_t pos = start; pos < end; pos = next) {
+        mmap_entry *ent = mmap_piece(pos, end, &next);
+        gd_memory_map_entry free = {
+            .physical_start = pos,
+            .size = next - pos,
+            .type = gd_conventional_memory,
+            .attributes = ent ? ent->entry.attributes : 0
+        };
+        mmap_insert_entry(&free_policy, free);
+    }
+    mmap_reclaim();
+    MMAP_CHECK();
     return 0;
 }
 
 void mmap_add_entry(gd_memory_map_entry entry)
+{
+    /* Early on there may be no memory described to grow into, and the
+     * static entries have to do
+     */
+    mmap_reserve_entries(MMAP_INSERT_ENTRIES);
+
+    if (entry.type != gd_conventional_memory)
+        zero_runs_forget(entry.physical_start,
+                         entry.physical_start + entry.size);
+    mmap_insert_entry(&insert_policy, entry);
+    mmap_reclaim();
+    MMAP_CHECK();
+}
+
+/*! Adds \p entry to the memory map, resolving overlaps according to
+ *  \p policy
+ */
+static void mmap_insert_entry(const struct mmap_policy *policy,
+                              gd_memory_map_entry entry)
 {
     if (!entry.size)
         return;
@@ -371,7 +1200,7 @@ void mmap_add_entry(gd_memory_map_entry entry)
             .size = 0x1000,
             .type = gd_unusable_memory
         };
-        mmap_add_entry(unusable);
+        mmap_insert_entry(policy, unusable);
         if (entry.size > (0x1000 - (entry.physical_start & 0xFFF)))
             entry.size -= 0x1000 - (entry.physical_start & 0xFFF);
         else return;
@@ -384,7 +1213,7 @@ void mmap_add_entry(gd_memory_map_entry entry)
             .size = 0x1000,
             .type = gd_unusable_memory
         };
-        mmap_add_entry(unusable);
+        mmap_insert_entry(policy, unusable);
         if (!(entry.size &= ~0xFFF))
             return;
     }
@@ -393,43 +1222,602 @@ void mmap_add_entry(gd_memory_map_entry entry)
     memcpy(&newent->entry, &entry, sizeof entry);
 
     mmap_entry *oldent;
-    if ((oldent = RB_INSERT(mmap_tree, &mmap, newent))) {
-        gd_memory_type type = higher_precedence(oldent->entry.type, newent->entry.type);
+    if ((oldent = mmap_insert(newent))) {
+        gd_memory_type type = higher_precedence(policy, oldent->entry.type,
+                                                newent->entry.type);
+        uint64_t attributes = overlap_attributes(policy, &oldent->entry,
+                                                 &newent->entry);
         if (oldent->entry.size == newent->entry.size) {
             oldent->entry.type = type;
+            oldent->entry.attributes = attributes;
+            mmap_update(oldent);
 
             mmap_free_entry(newent);
             merge_adjacent(oldent);
         } else if (oldent->entry.size > newent->entry.size) {
             newent->entry.type = type;
+            newent->entry.attributes = attributes;
             oldent->entry.size -= newent->entry.size;
             oldent->entry.physical_start += newent->entry.size;
+            mmap_update(oldent);
 
-            if (RB_INSERT(mmap_tree, &mmap, newent))
+            if (mmap_insert(newent))
                 panic("Bad memory map tree?");
 
             /* New entry can't overlap. */
             merge_adjacent(newent);
         } else { // oldent->entry.size < newent->entry.size
             oldent->entry.type = type;
-            newent->entry.size -= oldent->entry.size;
-            newent->entry.physical_start += oldent->entry.size;
-
-            if (RB_INSERT(mmap_tree, &mmap, newent))
-                panic("Bad memory map tree?");
+            oldent->entry.attributes = attributes;
+            mmap_update(oldent);
+
+            /* The rest of the new entry may start exactly where the next
+             * entry does, so add it afresh.
+             */
+            gd_memory_map_entry rest = newent->entry;
+            rest.size -= oldent->entry.size;
+            rest.physical_start += oldent->entry.size;
+            mmap_free_entry(newent);
+            merge_adjacent(oldent);
 
-            /* New entry can't overlap with previous entry. */
-            fix_overlap(newent); merge_adjacent(newent);
+            mmap_insert_entry(policy, rest);
+            return;
         }
     } else {
-        fix_overlap(newent);
-        fix_overlap(RB_PREV(mmap_tree, &mmap, newent));
-        merge_adjacent(newent);
+        uint64_t start = newent->entry.physical_start;
+        fix_overlap(policy, newent);
+        fix_overlap(policy, RB_PREV(mmap_tree, &mmap, newent));
+
+        /* The previous entry may have swallowed the new one */
+        merge_adjacent(mmap_lookup(start));
     }
 
     ++mmap_key;
 }
 
+/*! Sorts \p entries by start address. Heapsort, as we cannot allocate */
+static void sort_entries(gd_memory_map_entry *entries, size_t count)
+{
+    #define SWAP_ENTRIES(a, b) do { \
+        gd_memory_map_entry tmp_ = entries[a]; \
+        entries[a] = entries[b]; entries[b] = tmp_; \
+    } while (0)
+
+    for (size_t i = count / 2; i-- > 0;) {
+        for (size_t root = i, child; (child = 2 * root + 1) < count; root = child) {
+            if (child + 1 < count && entries[child + 1].physical_start
+                    > entries[child].physical_start)
+                child++;
+            if (entries[root].physical_start >= entries[child].physical_start)
+                break;
+            SWAP_ENTRIES(root, child);
+        }
+    }
+
+    for (size_t end = count; end-- > 1;) {
+        SWAP_ENTRIES(0, end);
+        for (size_t root = 0, child; (child = 2 * root + 1) < end; root = child) {
+            if (child + 1 < end && entries[child + 1].physical_start
+                    > entries[child].physical_start)
+                child++;
+            if (entries[root].physical_start >= entries[child].physical_start)
+                break;
+            SWAP_ENTRIES(root, child);
+        }
+    }
+
+    #undef SWAP_ENTRIES
+}
+
+/*! State of a sweep over the existing memory map and a sorted batch of new
+ *  entries.
+ *
+ *  The sweep visits every interval in start address order. For each precedence
+ *  rank it remembers the furthest end address of any interval of that rank
+ *  seen so far; a rank covers the current position exactly when that end lies
+ *  beyond it. The type of memory at any position is therefore the lowest rank
+ *  still active, found in constant time.
+ *
+ *  Attributes are tracked the same way, per rank and per attribute bit, so
+ *  that the attributes at any position are those of the intervals of the
+ *  winning rank which actually cover it.
+ *
+ *  A sweep is first run without \p commit to find out how many entries the
+ *  result needs, and then run again to build it.
+ */
+struct mmap_sweep {
+    const struct mmap_policy *policy;
+    bool                 commit;
+    gd_memory_map_entry *entries;
+    size_t               count, next_entry;
+    mmap_entry          *next_old;
+
+    uint64_t             until[NTYPES];
+    /*! Attribute bits seen on intervals of each rank */
+    uint64_t             attributes_seen[NTYPES];
+
+    /*! The last range found, before rounding to pages */
+    gd_memory_map_entry  raw;
+    bool                 have_raw;
+
+    /*! The last output range, which may still be extended */
+    gd_memory_map_entry  pending;
+    bool                 have_pending;
+
+    mmap_entry          *out_head, *out_tail;
+    size_t               out_count;
+    /*! Old entries released back to the free list during this sweep */
+    size_t               recycled;
+    /*! Greatest number of new entries needed at any one time */
+    size_t               peak;
+};
+
+/*! For each rank and attribute bit, the furthest end address of any interval
+ *  of that rank with that bit set. Too large for the stack; as only one sweep
+ *  runs at a time, it lives here.
+ */
+static uint64_t sweep_attributes_until[NTYPES][64];
+
+static void sweep_flush(struct mmap_sweep *sw)
+{
+    if (!sw->have_pending)
+        return;
+
+    sw->out_count++;
+    if (sw->out_count > sw->recycled && sw->out_count - sw->recycled > sw->peak)
+        sw->peak = sw->out_count - sw->recycled;
+
+    if (sw->commit) {
+        mmap_entry *ent = mmap_take_entry();
+        if (!ent)
+            panic("mmap: entries exhausted building memory map");
+
+        ent->entry = sw->pending;
+        ent->rbnode.rbe_right = NULL;
+        if (sw->out_tail)
+            sw->out_tail->rbnode.rbe_right = ent;
+        else
+            sw->out_head = ent;
+        sw->out_tail = ent;
+    }
+
+    sw->have_pending = false;
+}
+
+/*! Outputs a page aligned range, coalescing it with the previous one */
+static void sweep_emit_aligned(struct mmap_sweep *sw, uint64_t start,
+                               uint64_t end, gd_memory_type type,
+                               uint64_t attributes)
+{
+    gd_memory_map_entry *last = &sw->pending;
+
+    if (sw->have_pending) {
+        uint64_t last_end = last->physical_start + last->size;
+
+        /* Only a shared unusable partial page can overlap */
+        if (start < last_end)
+            start = last_end;
+        if (start >= end)
+            return;
+
+        if (last_end == start && last->type == type
+                && last->attributes == attributes) {
+            last->size += end - start;
+            return;
+        }
+    }
+
+    sweep_flush(sw);
+    last->type           = type;
+    last->physical_start = start;
+    last->virtual_start  = 0;
+    last->size           = end - start;
+    last->attributes     = attributes;
+    sw->have_pending     = true;
+}
+
+/*! Rounds the last range found to pages and outputs it. Pages which are only
+ *  partially described by a single type become unusable.
+ */
+static void sweep_emit_raw(struct mmap_sweep *sw)
+{
+    if (!sw->have_raw)
+        return;
+
+    uint64_t start      = sw->raw.physical_start;
+    uint64_t end        = start + sw->raw.size;
+    uint64_t start_page = start & ~(uint64_t) 0xFFF;
+    uint64_t end_page   = end   & ~(uint64_t) 0xFFF;
+    uint64_t inner      = (start + 0xFFF) & ~(uint64_t) 0xFFF;
+
+    if (start != start_page)
+        sweep_emit_aligned(sw, start_page, start_page + 0x1000,
+                           gd_unusable_memory, 0);
+
+    if (inner < end_page)
+        sweep_emit_aligned(sw, inner, end_page, sw->raw.type,
+                           sw->raw.attributes);
+
+    if (end != end_page && end_page >= inner && end_page + 0x1000 > end_page)
+        sweep_emit_aligned(sw, end_page, end_page + 0x1000,
+                           gd_unusable_memory, 0);
+
+    sw->have_raw = false;
+}
+
+/*! Outputs the range [\p start, \p end) of memory. Consecutive ranges of
+ *  the same type are joined before rounding, so that a page is only lost
+ *  where the type really changes.
+ */
+static void sweep_emit(struct mmap_sweep *sw, uint64_t start, uint64_t end,
+                       gd_memory_type type, uint64_t attributes)
+{
+    gd_memory_map_entry *raw = &sw->raw;
+
+    if (sw->have_raw && raw->physical_start + raw->size == start
+            && raw->type == type && raw->attributes == attributes) {
+        raw->size += end - start;
+        return;
+    }
+
+    sweep_emit_raw(sw);
+    raw->type           = type;
+    raw->physical_start = start;
+    raw->virtual_start  = 0;
+    raw->size           = end - start;
+    raw->attributes     = attributes;
+    sw->have_raw        = true;
+}
+
+/*! Returns the start of the next unvisited interval, or UINT64_MAX */
+static uint64_t sweep_next_start(struct mmap_sweep *sw)
+{
+    uint64_t start = UINT64_MAX;
+    if (sw->next_entry < sw->count)
+        start = sw->entries[sw->next_entry].physical_start;
+    if (sw->next_old && sw->next_old->entry.physical_start < start)
+        start = sw->next_old->entry.physical_start;
+    return start;
+}
+
+static void sweep_activate(struct mmap_sweep *sw,
+                           const gd_memory_map_entry *ent)
+{
+    unsigned rank = precedence_rank(sw->policy, ent->type);
+    uint64_t end  = ent->physical_start + ent->size;
+
+    if (end < ent->physical_start)
+        end = UINT64_MAX;
+
+    if (end > sw->until[rank])
+        sw->until[rank] = end;
+
+    /* Bits not yet seen in this sweep hold whatever the last one left */
+    uint64_t *until = sweep_attributes_until[rank];
+    uint64_t fresh  = ent->attributes & ~sw->attributes_seen[rank];
+    uint64_t bits   = ent->attributes;
+    for (unsigned bit = 0; bits; bit++, bits >>= 1) {
+        if (!(bits & 1))
+            continue;
+        if ((fresh >> bit & 1) || end > until[bit])
+            until[bit] = end;
+    }
+    sw->attributes_seen[rank] |= ent->attributes;
+}
+
+/*! Returns the attributes of the intervals of rank \p rank which cover
+ *  \p pos, and lowers \p *next to where they next change
+ */
+static uint64_t sweep_attributes(struct mmap_sweep *sw, unsigned rank,
+                                 uint64_t pos, uint64_t *next)
+{
+    uint64_t bits = sw->attributes_seen[rank];
+    uint64_t *until = sweep_attributes_until[rank];
+    uint64_t attributes = 0;
+
+    for (unsigned bit = 0; bits; bit++, bits >>= 1) {
+        if (!(bits & 1) || until[bit] <= pos)
+            continue;
+
+        attributes |= (uint64_t) 1 << bit;
+        if (until[bit] < *next)
+            *next = until[bit];
+    }
+    return attributes;
+}
+
+static void mmap_sweep_run(struct mmap_sweep *sw, mmap_entry *old)
+{
+    memset(sw->until, 0, sizeof sw->until);
+    memset(sw->attributes_seen, 0, sizeof sw->attributes_seen);
+    sw->next_entry   = 0;
+    sw->next_old     = old;
+    sw->have_raw     = false;
+    sw->have_pending = false;
+    sw->out_head     = sw->out_tail = NULL;
+    sw->out_count    = sw->recycled = sw->peak = 0;
+
+    uint64_t pos = sweep_next_start(sw);
+    while (pos != UINT64_MAX) {
+        while (sw->next_entry < sw->count
+                && sw->entries[sw->next_entry].physical_start <= pos) {
+            sweep_activate(sw, &sw->entries[sw->next_entry]);
+            sw->next_entry++;
+        }
+
+        while (sw->next_old && sw->next_old->entry.physical_start <= pos) {
+            mmap_entry *ent = sw->next_old;
+            sweep_activate(sw, &ent->entry);
+
+            if (sw->commit) {
+                sw->next_old = ent->rbnode.rbe_right;
+                mmap_free_entry(ent);
+            } else {
+                sw->next_old = RB_NEXT(mmap_tree, &mmap, ent);
+            }
+            sw->recycled++;
+        }
+
+        unsigned best = NTYPES;
+        for (unsigned rank = 0; rank < NTYPES; rank++) {
+            if (sw->until[rank] > pos) {
+                best = rank;
+                break;
+            }
+        }
+
+        uint64_t next = sweep_next_start(sw);
+        if (best != NTYPES) {
+            if (sw->until[best] < next)
+                next = sw->until[best];
+
+            uint64_t attributes = sweep_attributes(sw, best, pos, &next);
+            sweep_emit(sw, pos, next, sw->policy->order[best], attributes);
+
+            if (next == UINT64_MAX)
+                break;
+        }
+
+        pos = next;
+    }
+
+    sweep_emit_raw(sw);
+    sweep_flush(sw);
+}
+
+/*! Threads the subtree rooted at \p ent onto a list, in order, through the
+ *  rbe_right fields
+ */
+static void mmap_flatten(mmap_entry *ent, mmap_entry **tail)
+{
+    if (!ent)
+        return;
+
+    mmap_entry *left  = RB_LEFT(ent, rbnode);
+    mmap_entry *right = RB_RIGHT(ent, rbnode);
+
+    mmap_flatten(left, tail);
+    (*tail)->rbnode.rbe_right = ent;
+    *tail = ent;
+    mmap_flatten(right, tail);
+}
+
+/*! Builds a balanced tree of \p count entries from the list \p *list.
+ *  Subtree sizes never differ by more than one, so every leaf lies on one of
+ *  the bottom two levels; colouring the bottom level red gives a valid
+ *  red-black tree.
+ */
+static mmap_entry *mmap_build(mmap_entry **list, size_t count,
+                              unsigned depth, unsigned red_depth)
+{
+    if (!count)
+        return NULL;
+
+    size_t nleft = count / 2;
+    mmap_entry *left = mmap_build(list, nleft, depth + 1, red_depth);
+    mmap_entry *ent  = *list;
+    *list = ent->rbnode.rbe_right;
+    mmap_entry *right = mmap_build(list, count - nleft - 1, depth + 1, red_depth);
+
+    RB_LEFT(ent, rbnode)   = left;
+    RB_RIGHT(ent, rbnode)  = right;
+    RB_PARENT(ent, rbnode) = NULL;
+    RB_COLOR(ent, rbnode)  = depth == red_depth ? RB_RED : RB_BLACK;
+    if (left)
+        RB_PARENT(left, rbnode) = ent;
+    if (right)
+        RB_PARENT(right, rbnode) = ent;
+
+    mmap_augment(ent);
+    return ent;
+}
+
+void mmap_add_entries(gd_memory_map_entry *entries, size_t count)
+{
+    struct mmap_sweep sw = { .policy = &insert_policy, .entries = entries };
+
+    /* Sizes are 64-bit; drop empty entries while we're at it */
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i].size)
+            entries[i--] = entries[--count];
+        else if (entries[i].type != gd_conventional_memory)
+            zero_runs_forget(entries[i].physical_start,
+                             entries[i].physical_start + entries[i].size);
+    }
+    if (!count)
+        return;
+
+    sort_entries(entries, count);
+    sw.count = count;
+
+    /* Make sure the result can be built without growing the entry pool part
+     * way through. Growing it changes the memory map, so count again after.
+     */
+    mmap_pool_init();
+    for (;;) {
+        sw.commit = false;
+        mmap_sweep_run(&sw, RB_MIN(mmap_tree, &mmap));
+
+        if (mmap_nfree >= sw.peak)
+            break;
+
+        if (!mmap_grow_entries()) {
+            if (count == 1)
+                panic("Out of memory");
+
+            /* There's no memory in the map to hold entries in yet, so build
+             * it up in halves; the first may describe some.
+             */
+            mmap_add_entries(entries, count / 2);
+            mmap_add_entries(entries + count / 2, count - count / 2);
+            return;
+        }
+    }
+
+    mmap_entry head, *tail = &head;
+    head.rbnode.rbe_right = NULL;
+    mmap_flatten(RB_ROOT(&mmap), &tail);
+    tail->rbnode.rbe_right = NULL;
+    RB_INIT(&mmap);
+
+    sw.commit = true;
+    mmap_sweep_run(&sw, head.rbnode.rbe_right);
+
+    unsigned height = 0;
+    while (((size_t) 1 << height) <= sw.out_count)
+        height++;
+
+    mmap_entry *list = sw.out_head;
+    RB_ROOT(&mmap) = mmap_build(&list, sw.out_count, 0,
+                                height > 1 ? height - 1 : UINT_MAX);
+
+    ++mmap_key;
+    mmap_reclaim();
+    MMAP_CHECK();
+}
+
+static void node_range_remove(size_t i)
+{
+    nnode_ranges--;
+    memmove(&node_ranges[i], &node_ranges[i + 1],
+            (nnode_ranges - i) * sizeof *node_ranges);
+}
+
+static bool node_range_insert(size_t i, gd_memory_node_entry range)
+{
+    if (nnode_ranges == MMAP_MAX_NODE_RANGES) {
+        printf("mmap: too many NUMA node ranges; ignoring %" PRIx64 "+%" PRIx64 "\n",
+               range.physical_start, range.size);
+        return false;
+    }
+
+    memmove(&node_ranges[i + 1], &node_ranges[i],
+            (nnode_ranges - i) * sizeof *node_ranges);
+    node_ranges[i] = range;
+    nnode_ranges++;
+    return true;
+}
+
+void mmap_add_node_range(uint64_t start, uint64_t size, uint32_t domain)
+{
+    if (!size)
+        return;
+    if (start + size < start)
+        size = UINT64_MAX - start;
+
+    uint64_t end = start + size;
+    size_t i = 0;
+
+    /* Trim back any ranges the new one overlaps */
+    while (i < nnode_ranges) {
+        gd_memory_node_entry *range = &node_ranges[i];
+        uint64_t range_end = range->physical_start + range->size;
+
+        if (range_end <= start) {
+            i++;
+        } else if (range->physical_start >= end) {
+            break;
+        } else if (range->physical_start < start && range_end > end) {
+            gd_memory_node_entry tail = *range;
+            tail.physical_start = end;
+            tail.size           = range_end - end;
+            range->size         = start - range->physical_start;
+            node_range_insert(++i, tail);
+            break;
+        } else if (range->physical_start < start) {
+            range->size = start - range->physical_start;
+            i++;
+        } else if (range_end > end) {
+            range->size           = range_end - end;
+            range->physical_start = end;
+            break;
+        } else {
+            node_range_remove(i);
+        }
+    }
+
+    gd_memory_node_entry range = {
+        .physical_start   = start,
+        .size             = size,
+        .proximity_domain = domain,
+    };
+
+    /* Join up with neighbours in the same domain */
+    if (i > 0 && node_ranges[i - 1].proximity_domain == domain
+            && node_ranges[i - 1].physical_start + node_ranges[i - 1].size == start) {
+        range.physical_start = node_ranges[i - 1].physical_start;
+        range.size += node_ranges[i - 1].size;
+        node_range_remove(--i);
+    }
+    if (i < nnode_ranges && node_ranges[i].proximity_domain == domain
+            && node_ranges[i].physical_start == end) {
+        range.size += node_ranges[i].size;
+        node_range_remove(i);
+    }
+
+    node_range_insert(i, range);
+}
+
+bool mmap_node_of(uint64_t addr, uint32_t *domain)
+{
+    size_t lo = 0, hi = nnode_ranges;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const gd_memory_node_entry *range = &node_ranges[mid];
+
+        if (addr < range->physical_start) {
+            hi = mid;
+        } else if (addr - range->physical_start >= range->size) {
+            lo = mid + 1;
+        } else {
+            *domain = range->proximity_domain;
+            return true;
+        }
+    }
+    return false;
+}
+
+int mmap_export_nodes(gd_memory_node_table **ptable)
+{
+    *ptable = NULL;
+    if (!nnode_ranges)
+        return 0;
+
+    size_t size = sizeof (gd_memory_node_table)
+                + nnode_ranges * sizeof (gd_memory_node_entry);
+    void *pages;
+    int rv = gd_alloc_pages(gd_loader_data, &pages, (size + 4095) / 4096);
+    if (rv)
+        return rv;
+
+    gd_memory_node_table *table = pages;
+    memcpy(table->entries, node_ranges, nnode_ranges * sizeof *node_ranges);
+    table->header.id     = GD_MEMORY_NODE_TABLE_ID;
+    table->header.length = size;
+    *ptable = table;
+    return 0;
+}
+
 void mmap_clean(void)
 {
     mmap_entry *mme, *next;
@@ -438,9 +1826,12 @@ void mmap_clean(void)
         RB_REMOVE(mmap_tree, &mmap, mme);
     }
 
-    alloc_next  = static_slots;
-    allocatable = MMAP_STATIC_SLOTS;
-    last_freed  = NULL;
+    /* Dynamically allocated slabs described memory in the old map; forget
+     * about them */
+    slabs_head  = slabs_tail = NULL;
+    mmap_nfree  = 0;
+    nzero_runs  = 0;
+    mmap_slab_init(&static_slab.slab, static_slab.entries, MMAP_STATIC_SLOTS);
 }
 
 void mmap_get(
@@ -461,4 +1852,45 @@ void mmap_get(
     *key = mmap_key;
 }
 
+/* Allocating the pages for an exported table may split a run of conventional
+ * memory in two, as may taking a page for more entries to do so.
+ */
+#define MMAP_EXPORT_SLACK 4
+
+int mmap_export(gd_memory_map_table **ptable, size_t *key)
+{
+    size_t count = 0;
+    mmap_entry *ent;
+    RB_FOREACH (ent, mmap_tree, &mmap) {
+        count++;
+    }
+
+    size_t size = sizeof (gd_memory_map_table)
+                + (count + MMAP_EXPORT_SLACK) * sizeof (gd_memory_map_entry);
+    void *pages;
+    int rv = gd_alloc_pages(gd_loader_data, &pages, (size + 4095) / 4096);
+    if (rv)
+        return rv;
+
+    gd_memory_map_table *table = pages;
+    size_t i = 0;
+    RB_FOREACH (ent, mmap_tree, &mmap) {
+        if (i == count + MMAP_EXPORT_SLACK)
+            panic("mmap: map grew while exporting it");
+        table->entries[i++] = ent->entry;
+    }
+
+    table->header.id     = GD_MEMORY_MAP_TABLE_ID;
+    table->header.length = sizeof (gd_memory_map_table)
+                         + i * sizeof (gd_memory_map_entry);
+    *ptable = table;
+    *key    = mmap_key;
+    return 0;
+}
+
+bool mmap_changed_since(size_t key)
+{
+    return key != mmap_key;
+}
+
 RB_GENERATE_STATIC(mmap_tree, mmap_entry, rbnode, mmap_entry_cmp)
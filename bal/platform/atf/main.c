@@ -8,24 +8,6 @@
 
 DEFINE_ARM_PL011(uart0, { (void*) 0x1C090000 }, 24000000);
 
-static void walk_children(void *fdt, int depth, int offset)
-{
-    printf("%*c -> %s is ", depth, ' ', fdt_get_name(fdt, offset, NULL));
-
-    int len;
-    const char* compatible = fdt_getprop(fdt, offset, "compatible", &len);
-    for (int p = 0; p < len; p += strlen(compatible + p) + 1) {
-        printf("\"%s\" ", compatible + p);
-    }
-    printf("\n");
-
-    int suboff = fdt_first_subnode(fdt, offset);
-    while (suboff != -FDT_ERR_NOTFOUND) {
-        walk_children(fdt, depth+1, suboff);
-        suboff = fdt_next_subnode(fdt, suboff);
-    }
-}
-
 void bal_main_atf(void *pdtree);
 void bal_main_atf(void *pdtree)
 {
@@ -45,9 +27,6 @@ void bal_main_atf(void *pdtree)
         printf("Reserved mem: %" PRIX64 " len=%" PRIX64 "\n", addr, sz);
     }
 
-    printf("Tree:\n");
-    walk_children(pdtree, 1, fdt_next_node(pdtree, -1, NULL));
-
     dt_platform_init_fdt(pdtree);
 
     for(;;);
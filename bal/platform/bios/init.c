@@ -19,6 +19,7 @@
 #include <bal/bios_console.h>
 #include <gd_common.h>
 #include <bal/mmap.h>
+#include <bal/misc.h>
 #include <platform/bios/bal/mmap.h>
 #include <bal/tables.h>
 #include <bal/vbe.h>
@@ -37,6 +38,27 @@ __asm__(
 "        jmp .\n"
 );
 
+/* The tables describing memory which are handed to the kernel */
+static gd_memory_map_table  *memory_map_table;
+static gd_memory_node_table *memory_node_table;
+static size_t                memory_map_key;
+
+/*! Exports the memory map, and the NUMA node ranges if there are any, for
+ *  the kernel. The node table is allocated first, so that the memory map is
+ *  the last allocation and describes everything, itself included.
+ */
+static void export_memory_tables(void)
+{
+    if (mmap_export_nodes(&memory_node_table))
+        panic("Out of memory exporting the NUMA node ranges");
+    if (mmap_export(&memory_map_table, &memory_map_key))
+        panic("Out of memory exporting the memory map");
+
+    printf("Memory map: %zu entries, %zu NUMA node ranges\n",
+           gd_mmap_get_size(memory_map_table),
+           memory_node_table ? gd_mmap_get_node_count(memory_node_table) : 0);
+}
+
 void __start(struct bios_service_table *pbios_services);
 void __start(struct bios_service_table *pbios_services)
 {
@@ -50,13 +72,8 @@ void __start(struct bios_service_table *pbios_services)
     tables_init();
     vbe_init();
 
-    /*gd_memory_map_entry mmap[100]; size_t nentries = 100, key = 0;
-    mmap_get(&mmap, nentries, &nentries, &key);
-    for (size_t i = 0; i < nentries; i++) {
-        printf("Entry %d: %llx -> %llx, %d\n", i, mmap[i].physical_start,
-               mmap[i].physical_start + mmap[i].size,
-               mmap[i].type);
-    }*/
+    /* Nothing may allocate memory after this, or the tables go stale */
+    export_memory_tables();
 
     //extern gd_rsdt_pointer_table rsdt_pointer;
     //extern gd_pc_pointer_table pc_pointer;
@@ -71,5 +88,8 @@ void __start(struct bios_service_table *pbios_services)
     //                                          pc_pointer.mpfp.signature[2],
     //                                          pc_pointer.mpfp.signature[3], pc_pointer.smbios_entry_point_address);
     //}
+
+    if (mmap_changed_since(memory_map_key))
+        panic("The memory map changed after it was exported");
     for(;;);
 }
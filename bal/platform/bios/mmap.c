@@ -31,25 +31,44 @@ gd_memory_type acpi_to_gd[] = {
     gd_unusable_memory       /* address_range_disabled */
 };
 
+/*! Ranges read from E820 are queued up here and added to the memory map in
+ *  batches, rather than one at a time.
+ */
+#define E820_BATCH 32
+static gd_memory_map_entry e820_batch[E820_BATCH];
+static size_t e820_batched = 0;
+
+static void flush_acpi_ranges(void)
+{
+    mmap_add_entries(e820_batch, e820_batched);
+    e820_batched = 0;
+}
+
 static void add_acpi_range(struct address_range range)
 {
     if (!(range.attributes & entry_present))
         return;
 
+    if (e820_batched == E820_BATCH)
+        flush_acpi_ranges();
+
     gd_memory_map_entry entry;
     entry.physical_start = range.physical_start;
     entry.virtual_start = 0;
     entry.size = range.size;
 
-    /* TODO: handle attributes. */
     entry.attributes = 0;
+    if (range.attributes & address_range_non_volatile)
+        entry.attributes |= GD_MEMORY_NV;
+    if (range.attributes & address_range_slow_access)
+        entry.attributes |= GD_MEMORY_SLOW;
 
     if (range.type < (sizeof acpi_to_gd / sizeof (gd_memory_type)))
         entry.type = acpi_to_gd[range.type];
     else
         entry.type = gd_unusable_memory;
 
-    mmap_add_entry(entry);
+    e820_batch[e820_batched++] = entry;
 }
 
 /*! Returns true on success, otherwise false. */
@@ -85,10 +104,11 @@ static bool try_e820()
 
         // List finished.
         if (regs.eflags & carry_flag)
-            return true;
+            break;
 
         // If invalid entry, reset.
         if ((regs.eax != 0x534D4150) || (regs.ecx < 20)) {
+            e820_batched = 0;
             mmap_clean();
             return false;
         }
@@ -96,6 +116,7 @@ static bool try_e820()
         add_acpi_range(range);
     } while (regs.ebx);
 
+    flush_acpi_ranges();
     return true;
 }
 
@@ -133,8 +154,7 @@ static bool try_e8x1(uint32_t eax)
           .type = gd_conventional_memory }
     };
 
-    mmap_add_entry(entries[0]);
-    mmap_add_entry(entries[1]);
+    mmap_add_entries(entries, 2);
     return true;
 }
 
@@ -173,8 +193,7 @@ static bool try_c7()
           .size = c7_memory_map->memory_16m * 1024,
           .type = gd_conventional_memory }
     };
-    mmap_add_entry(entries[0]);
-    mmap_add_entry(entries[1]);
+    mmap_add_entries(entries, 2);
     return true;
 }
 
@@ -245,8 +264,7 @@ void mmap_init()
               .size = 0x100000,
               .type = gd_unusable_memory }
         };
-        for (size_t i = 0; i < sizeof entries / sizeof (gd_memory_map_entry); i++)
-            mmap_add_entry(entries[i]);
+        mmap_add_entries(entries, sizeof entries / sizeof (gd_memory_map_entry));
 
         if((try_e8x1(0xe881) == false) &&
            (try_e8x1(0xe801) == false) &&
@@ -257,25 +275,23 @@ void mmap_init()
                 .type = gd_conventional_memory
             };
 
-            mmap_add_entry(entry);
+            mmap_add_entries(&entry, 1);
         }
     }
 
     /* todo: pxe */
     /* todo: self */
-    gd_memory_map_entry low_mem = {
-        .physical_start = 0x0000,
+    gd_memory_map_entry fixed[] = {
         /*! IVT and BDA (till 0x501). */
-        .size = 0x1000,
-        .type = gd_unusable_memory
-    };
-
-    // TODO: make this proper.
-    gd_memory_map_entry gandr_mem = {
-        .physical_start = 0x8000,
-        .size = (0x30000 - 0x8000),
-        .type = gd_loader_code
+        { .physical_start = 0x0000,
+          .size = 0x1000,
+          .type = gd_unusable_memory },
+
+        // TODO: make this proper.
+        { .physical_start = 0x8000,
+          .size = (0x30000 - 0x8000),
+          .type = gd_loader_code }
     };
 
-    mmap_add_entry(low_mem); mmap_add_entry(gandr_mem);
+    mmap_add_entries(fixed, sizeof fixed / sizeof (gd_memory_map_entry));
 }
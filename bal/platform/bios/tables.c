@@ -14,6 +14,7 @@
  */
 
 #include <bal/tables.h>
+#include <bal/mmap.h>
 #include <platform/bios/bal/mmap.h>
 #include <gd_common.h>
 #include <stdbool.h>
@@ -76,6 +77,69 @@ static void search_region(const uint8_t *region, size_t length, bool rsdp_search
     }
 }
 
+/*! Returns the ACPI table at \p address if it is mapped and valid, or NULL. */
+static const struct acpi_sdt_header *acpi_table(uint64_t address)
+{
+    if (!address || address > UINTPTR_MAX)
+        return NULL;
+
+    const struct acpi_sdt_header *table = (void*)(uintptr_t) address;
+    if (table->length < sizeof *table ||
+        checksum_table((const uint8_t*) table, table->length) != 0)
+        return NULL;
+    return table;
+}
+
+/*! Finds the ACPI table with signature \p signature through the XSDT, or the
+ *  RSDT if there is no XSDT. */
+static const struct acpi_sdt_header *find_acpi_table(uint32_t signature)
+{
+    const struct acpi_sdt_header *root = acpi_table(rsdt_pointer.xsdt_address);
+    size_t entry_size = sizeof (uint64_t);
+    if (!root) {
+        root = acpi_table(rsdt_pointer.rsdt_address);
+        entry_size = sizeof (uint32_t);
+    }
+    if (!root)
+        return NULL;
+
+    const uint8_t *entries = (const uint8_t*) (root + 1);
+    size_t count = (root->length - sizeof *root) / entry_size;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t address = 0;
+        memcpy(&address, entries + i * entry_size, entry_size);
+
+        const struct acpi_sdt_header *table = acpi_table(address);
+        if (table &&
+            TABLE_SIGNATURE(table->signature[0], table->signature[1],
+                            table->signature[2], table->signature[3]) == signature)
+            return table;
+    }
+    return NULL;
+}
+
+/*! Records the NUMA proximity domain of each memory range described by the
+ *  SRAT, if there is one. */
+static void srat_init()
+{
+    const struct acpi_sdt_header *srat = find_acpi_table(SRAT_SIGNATURE);
+    if (!srat || srat->length < sizeof (struct acpi_srat))
+        return;
+
+    const uint8_t *entry = (const uint8_t*) srat + sizeof (struct acpi_srat);
+    const uint8_t *end = (const uint8_t*) srat + srat->length;
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+        const struct srat_memory_affinity *mem = (const void*) entry;
+        if (mem->type == SRAT_MEMORY_AFFINITY &&
+            mem->length >= sizeof *mem &&
+            (mem->flags & SRAT_MEMORY_ENABLED)) {
+            mmap_add_node_range(mem->base_address, mem->length_bytes,
+                                mem->proximity_domain);
+        }
+        entry += entry[1];
+    }
+}
+
 /*! Find all the available tables. The respective gd_* tables have non-zero 
  *  size if any tables they describe have been located. */
 void tables_init()
@@ -116,4 +180,7 @@ void tables_init()
     search_region((uint8_t*) 0xF0000, 0x10000, true && !rsdt_pointer.header.length,
                                                true && !pc_pointer.mpfp.length,
                                                true);
+
+    if (rsdt_pointer.header.length)
+        srat_init();
 }
@@ -15,6 +15,7 @@
 
 #include <bal/bios_services.h>
 #include <bal/vbe.h>
+#include <bal/arena.h>
 #include <gd_queue.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,7 @@ typedef struct mode_list_entry {
 } mode_list_entry;
 
 static SLIST_HEAD(mode_list, mode_list_entry) modes = SLIST_HEAD_INITIALIZER(&modes);
+static struct arena mode_arena = ARENA_INITIALIZER;
 
 struct mode_brief {
     uint16_t width;                 /* In pixels (graphics) or characters (text). */
@@ -298,14 +300,15 @@ void vbe_init()
             else continue;
         }
 
-        mode_list_entry *new_entry = malloc(sizeof *new_entry);
+        mode_list_entry *new_entry = arena_alloc(&mode_arena, sizeof *new_entry,
+                                                 _Alignof(mode_list_entry));
         if (!new_entry) {
             // TODO: Show warning.
             return;
         }
 
         // Add to list.
-        memcpy(&new_entry->node, &new_mode, sizeof (struct mode_info));
+        memcpy(&new_entry->entry, &new_mode, sizeof (struct mode_info));
         SLIST_INSERT_HEAD(&modes, new_entry, node);
 
         if (new_mode.width > 700 && new_mode.depth == 32) break;
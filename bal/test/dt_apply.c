@@ -0,0 +1,140 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Applies overlays which are refused, one for a missing target and one
+ * nested too deeply, each after a fragment which would have applied. The
+ * tree must be left as it was. Then applies the good fragment on its own.
+ */
+
+#include "host.h"
+#include <bal/device/dt.h>
+#include <bal/mmap.h>
+#include <errno.h>
+#include <libfdt.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (64 << 20)
+#define BLOB_SIZE    8192
+#define DEEP         40
+
+DT_DECLARE_DEVICE_DRIVER(unused_driver, "vendor,unused", NULL)
+
+static char blob[BLOB_SIZE], overlay[BLOB_SIZE];
+
+static void property_u32(void *fdt, const char *name, uint32_t v)
+{
+    fdt32_t cell = cpu_to_fdt32(v);
+    CHECK(!fdt_property(fdt, name, &cell, sizeof cell));
+}
+
+static void property_string(void *fdt, const char *name, const char *v)
+{
+    CHECK(!fdt_property(fdt, name, v, strlen(v) + 1));
+}
+
+/*! Builds the base blob, describing \p memory */
+static void build_blob(uint64_t memory)
+{
+    CHECK(!fdt_create(blob, BLOB_SIZE));
+    CHECK(!fdt_finish_reservemap(blob));
+    CHECK(!fdt_begin_node(blob, ""));
+    property_u32(blob, "#address-cells", 2);
+    property_u32(blob, "#size-cells", 2);
+
+    CHECK(!fdt_begin_node(blob, "memory@0"));
+    property_string(blob, "device_type", "memory");
+    fdt32_t reg[4] = {
+        cpu_to_fdt32(memory >> 32), cpu_to_fdt32(memory),
+        cpu_to_fdt32(0), cpu_to_fdt32(MEMORY_SIZE),
+    };
+    CHECK(!fdt_property(blob, "reg", reg, sizeof reg));
+    CHECK(!fdt_end_node(blob));
+
+    CHECK(!fdt_begin_node(blob, "soc"));
+    property_u32(blob, "#address-cells", 1);
+    property_u32(blob, "#size-cells", 1);
+    CHECK(!fdt_end_node(blob));
+
+    CHECK(!fdt_end_node(blob));
+    CHECK(!fdt_finish(blob));
+}
+
+/*! Adds fragment \p name targetting \p target, with \p depth levels of
+ *  nodes under its __overlay__
+ */
+static void add_fragment(const char *name, const char *target, unsigned depth)
+{
+    CHECK(!fdt_begin_node(overlay, name));
+    property_string(overlay, "target-path", target);
+    CHECK(!fdt_begin_node(overlay, "__overlay__"));
+    property_u32(overlay, "added", 1);
+    for (unsigned i = 0; i < depth; i++) {
+        CHECK(!fdt_begin_node(overlay, "nested"));
+        property_u32(overlay, "level", i);
+    }
+    for (unsigned i = 0; i < depth; i++)
+        CHECK(!fdt_end_node(overlay));
+    CHECK(!fdt_end_node(overlay));
+    CHECK(!fdt_end_node(overlay));
+}
+
+/*! Builds an overlay with a good fragment, followed by one targetting
+ *  \p target with \p depth levels if \p target isn't NULL
+ */
+static void build_overlay(const char *target, unsigned depth)
+{
+    CHECK(!fdt_create(overlay, BLOB_SIZE));
+    CHECK(!fdt_finish_reservemap(overlay));
+    CHECK(!fdt_begin_node(overlay, ""));
+    add_fragment("fragment@0", "/soc", 2);
+    if (target)
+        add_fragment("fragment@1", target, depth);
+    CHECK(!fdt_end_node(overlay));
+    CHECK(!fdt_finish(overlay));
+}
+
+/*! Checks that applying the overlay fails with \p error and leaves the
+ *  tree alone
+ */
+static void check_refused(int error)
+{
+    uint32_t changes = dt_change_count;
+    dt_node_t dirty = dt_dirty_nodes;
+
+    CHECK(dt_overlay_apply(overlay) == error);
+    CHECK(dt_change_count == changes && dt_dirty_nodes == dirty);
+
+    dt_node_t soc = dt_find_node_by_path("/soc", 4);
+    CHECK(!dt_node_has_property(soc, "added") && !dt_node_child_count(soc));
+}
+
+int main(void)
+{
+    build_blob((uintptr_t) host_memory(MEMORY_SIZE));
+    dt_platform_init_fdt(blob);
+
+    build_overlay("/missing", 1);
+    check_refused(ENOENT);
+
+    build_overlay("/", DEEP);
+    check_refused(EINVAL);
+
+    build_overlay(NULL, 0);
+    CHECK(!dt_overlay_apply(overlay));
+    dt_node_t node = dt_find_node_by_path("/soc/nested/nested", 18);
+    CHECK(node && dt_node_has_property(node, "level"));
+    CHECK(dt_node_has_property(dt_find_node_by_path("/soc", 4), "added"));
+    return 0;
+}
@@ -0,0 +1,413 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Times device tree lookups and measures the memory the tree takes: every
+ * property of every node, properties a node doesn't have, and every child by
+ * name. Every answer is checked against libfdt.
+ *
+ * Only calls which the red-black tree layout also had are used, so that the
+ * layouts can be compared by building this file and host.c, unchanged,
+ * against the Bal sources of the revision before the sorted arrays came in
+ * ("Expand the device tree from the FDT on demand"), and running both on the
+ * same blob.
+ *
+ * Usage: dt_bench [dtb]
+ *
+ * Without a blob, a synthetic one shaped like a large SoC is used.
+ */
+
+#include "host.h"
+#include <bal/device/dt.h>
+#include <bal/mmap.h>
+#include <libfdt.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (UINT64_C(1) << 30)
+#define MAX_DEPTH    32
+/* Each kind of lookup is repeated until it has made at least this many */
+#define MIN_LOOKUPS  2000000
+
+void *system_fdt;
+static dt_node_t root;
+
+dt_node_t dt_root_node(void)
+{
+    return root;
+}
+
+struct query {
+    dt_node_t   node;
+    const char *name;
+};
+
+/* Every node of the blob, in its order */
+static dt_node_t *nodes;
+static size_t nnodes, nproperties;
+
+/* Property names of the synthetic blob; the lookups which miss ask each node
+ * for names from here which it lacks
+ */
+static const char *const property_names[] = {
+    "compatible", "reg", "interrupts", "interrupt-parent", "clocks",
+    "clock-names", "resets", "reset-names", "status", "pinctrl-names",
+    "pinctrl-0", "phandle", "#address-cells", "#size-cells", "dmas",
+    "dma-names", "power-domains", "assigned-clocks", "assigned-clock-rates",
+    "iommus", "ranges", "interrupt-names", "label", "linux,phandle",
+};
+#define NPROPERTY_NAMES (sizeof property_names / sizeof *property_names)
+
+static const char *const device_classes[] = {
+    "serial", "i2c", "spi", "gpio", "mmc", "usb", "ethernet", "timer",
+    "watchdog", "pwm", "dma-controller", "clock-controller",
+};
+#define NDEVICE_CLASSES (sizeof device_classes / sizeof *device_classes)
+
+static void property_u32(void *fdt, const char *name, uint32_t v)
+{
+    fdt32_t cell = cpu_to_fdt32(v);
+    CHECK(!fdt_property(fdt, name, &cell, sizeof cell));
+}
+
+static void property_string(void *fdt, const char *name, const char *v)
+{
+    CHECK(!fdt_property(fdt, name, v, strlen(v) + 1));
+}
+
+/*! Builds a blob with \p ndevices devices on one bus, every eighth of which
+ *  is a bus with four devices of its own
+ */
+static void *synthetic_fdt(unsigned ndevices)
+{
+    size_t size = 512 + ndevices * 1024;
+    void *fdt = malloc(size);
+    CHECK(fdt);
+
+    CHECK(!fdt_create(fdt, size));
+    CHECK(!fdt_finish_reservemap(fdt));
+    CHECK(!fdt_begin_node(fdt, ""));
+    property_string(fdt, "compatible", "vendor,board");
+    property_string(fdt, "model", "Synthetic board");
+    property_u32(fdt, "#address-cells", 1);
+    property_u32(fdt, "#size-cells", 1);
+
+    CHECK(!fdt_begin_node(fdt, "soc"));
+    property_string(fdt, "compatible", "simple-bus");
+    property_u32(fdt, "#address-cells", 1);
+    property_u32(fdt, "#size-cells", 1);
+    CHECK(!fdt_property(fdt, "ranges", NULL, 0));
+
+    for (unsigned i = 0; i < ndevices; i++) {
+        const char *class = device_classes[i % NDEVICE_CLASSES];
+        uint32_t addr = 0x10000000 + i * 0x1000;
+        char name[64], compatible[64];
+        fdt32_t cells[4];
+
+        snprintf(name, sizeof name, "%s@%" PRIx32, class, addr);
+        CHECK(!fdt_begin_node(fdt, name));
+
+        int len = snprintf(compatible, sizeof compatible, "vendor,soc-%s-%u",
+                           class, i % 7) + 1;
+        len += snprintf(compatible + len, sizeof compatible - len, "vendor,%s",
+                        class) + 1;
+        CHECK(!fdt_property(fdt, "compatible", compatible, len));
+
+        cells[0] = cpu_to_fdt32(addr);
+        cells[1] = cpu_to_fdt32(0x1000);
+        CHECK(!fdt_property(fdt, "reg", cells, 2 * sizeof *cells));
+        cells[0] = cpu_to_fdt32(0);
+        cells[1] = cpu_to_fdt32(32 + i);
+        cells[2] = cpu_to_fdt32(4);
+        CHECK(!fdt_property(fdt, "interrupts", cells, 3 * sizeof *cells));
+        cells[0] = cpu_to_fdt32(1);
+        cells[1] = cpu_to_fdt32(i);
+        CHECK(!fdt_property(fdt, "clocks", cells, 2 * sizeof *cells));
+        property_string(fdt, "clock-names", "bus");
+        property_string(fdt, "status", i % 5 ? "okay" : "disabled");
+        property_string(fdt, "pinctrl-names", "default");
+        property_u32(fdt, "pinctrl-0", 0x8000 + i);
+        property_u32(fdt, "phandle", 2 + i);
+
+        if (i % 8 == 1) {
+            property_u32(fdt, "#address-cells", 1);
+            property_u32(fdt, "#size-cells", 0);
+            for (unsigned j = 0; j < 4; j++) {
+                snprintf(name, sizeof name, "device@%x", 0x10 + j);
+                CHECK(!fdt_begin_node(fdt, name));
+                property_string(fdt, "compatible", "vendor,sensor");
+                property_u32(fdt, "reg", 0x10 + j);
+                CHECK(!fdt_end_node(fdt));
+            }
+        } else if (i % 3 == 0) {
+            cells[0] = cpu_to_fdt32(2);
+            cells[1] = cpu_to_fdt32(i);
+            CHECK(!fdt_property(fdt, "dmas", cells, 2 * sizeof *cells));
+            property_string(fdt, "dma-names", "rx");
+        }
+        CHECK(!fdt_end_node(fdt));
+    }
+
+    CHECK(!fdt_end_node(fdt));
+    CHECK(!fdt_end_node(fdt));
+    CHECK(!fdt_finish(fdt));
+    return fdt;
+}
+
+static void *read_fdt(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+
+    struct fdt_header header;
+    CHECK(fread(&header, sizeof header, 1, f) == 1);
+    CHECK(!fdt_check_header(&header));
+
+    void *fdt = malloc(fdt_totalsize(&header));
+    CHECK(fdt);
+    rewind(f);
+    CHECK(fread(fdt, fdt_totalsize(&header), 1, f) == 1);
+    fclose(f);
+    return fdt;
+}
+
+/*! Bytes the arenas have taken from the memory map */
+static uint64_t arena_bytes(void)
+{
+    static gd_memory_map_entry map[1024];
+    size_t count, key;
+    mmap_get(map, 1024, &count, &key);
+    CHECK(count <= 1024);
+
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (map[i].type == gd_boot_services_data)
+            bytes += map[i].size;
+    }
+    return bytes;
+}
+
+/*! Creates the node for every node of \p fdt, as the tree does it: a node
+ *  already expanded from its parent is looked up, any other one allocated
+ */
+static void load(void *fdt)
+{
+    size_t capacity = 1024;
+    nodes = malloc(capacity * sizeof *nodes);
+    CHECK(nodes);
+
+    dt_node_t stack[MAX_DEPTH];
+    int depth = -1;
+    for (int offset = fdt_next_node(fdt, -1, &depth);
+             offset >= 0 && depth >= 0;
+             offset = fdt_next_node(fdt, offset, &depth)) {
+        CHECK(depth < MAX_DEPTH);
+
+        if (nnodes == capacity) {
+            capacity *= 2;
+            nodes = realloc(nodes, capacity * sizeof *nodes);
+            CHECK(nodes);
+        }
+
+        dt_node_t node = NULL;
+        if (depth)
+            node = dt_node_find_child(stack[depth - 1],
+                                      fdt_get_name(fdt, offset, NULL));
+        if (!node)
+            node = dt_node_alloc_fdt(depth ? stack[depth - 1] : NULL, offset);
+        CHECK(node && node->fdt_offset == offset);
+        if (!depth)
+            root = node;
+        nodes[nnodes++] = stack[depth] = node;
+
+        for (int prop = fdt_first_property_offset(fdt, offset); prop >= 0;
+                 prop = fdt_next_property_offset(fdt, prop))
+            nproperties++;
+    }
+}
+
+/*! Copies \p name, so that lookups can't match on the pointer */
+static const char *query_name(const char *name)
+{
+    char *copy = strdup(name);
+    CHECK(copy);
+    return copy;
+}
+
+static void shuffle(struct query *queries, size_t count)
+{
+    for (size_t i = count; i > 1; i--) {
+        size_t j = host_random() % i;
+        struct query t = queries[i - 1];
+        queries[i - 1] = queries[j];
+        queries[j] = t;
+    }
+}
+
+/*! Asks every node for each of its properties if \p hit, or else for each
+ *  name of property_names it lacks
+ */
+static struct query *property_queries(void *fdt, bool hit, size_t *count)
+{
+    size_t capacity = hit ? nproperties : nnodes * NPROPERTY_NAMES;
+    struct query *queries = malloc((capacity ? capacity : 1) * sizeof *queries);
+    CHECK(queries);
+
+    *count = 0;
+    for (size_t i = 0; i < nnodes; i++) {
+        int offset = nodes[i]->fdt_offset;
+        if (hit) {
+            for (int prop = fdt_first_property_offset(fdt, offset); prop >= 0;
+                     prop = fdt_next_property_offset(fdt, prop)) {
+                const char *name;
+                CHECK(fdt_getprop_by_offset(fdt, prop, &name, NULL));
+                queries[(*count)++] = (struct query) {
+                    nodes[i], query_name(name) };
+            }
+        } else {
+            for (size_t j = 0; j < NPROPERTY_NAMES; j++) {
+                if (!fdt_getprop(fdt, offset, property_names[j], NULL)) {
+                    queries[(*count)++] = (struct query) {
+                        nodes[i], query_name(property_names[j]) };
+                }
+            }
+        }
+    }
+    shuffle(queries, *count);
+    return queries;
+}
+
+/*! Asks the parent of every node but the root for the node by name */
+static struct query *child_queries(void *fdt, size_t *count)
+{
+    struct query *queries = malloc(nnodes * sizeof *queries);
+    CHECK(queries);
+
+    *count = 0;
+    for (size_t i = 0; i < nnodes; i++) {
+        if (nodes[i]->parent) {
+            queries[(*count)++] = (struct query) { nodes[i]->parent,
+                query_name(fdt_get_name(fdt, nodes[i]->fdt_offset, NULL)) };
+        }
+    }
+    shuffle(queries, *count);
+    return queries;
+}
+
+/*! Checks the tree's answer to every query against \p fdt. This is also what
+ *  reads every property in, where the tree does that on demand.
+ */
+static void check_answers(void *fdt, const struct query *queries, size_t count,
+                          bool children)
+{
+    for (size_t i = 0; i < count; i++) {
+        dt_node_t node = queries[i].node;
+        if (children) {
+            dt_node_t child = dt_node_find_child(node, queries[i].name);
+            CHECK(child && child->fdt_offset == fdt_subnode_offset(fdt,
+                node->fdt_offset, queries[i].name));
+        } else {
+            int len;
+            const void *value = fdt_getprop(fdt, node->fdt_offset,
+                                            queries[i].name, &len);
+            dt_property_t p = dt_node_find_property(node, queries[i].name);
+            CHECK(!p == !value);
+            CHECK(!p || (p->value_len == (size_t) len
+                         && !memcmp(p->value, value, len)));
+        }
+    }
+}
+
+/*! Nanoseconds per lookup of \p queries */
+static double time_properties(const struct query *queries, size_t count)
+{
+    if (!count)
+        return 0;
+
+    unsigned rounds = (MIN_LOOKUPS + count - 1) / count;
+    uintptr_t sum = 0;
+    uint64_t start = host_time_ns();
+    for (unsigned r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < count; i++) {
+            dt_property_t p = dt_node_find_property(queries[i].node,
+                                                    queries[i].name);
+            sum += p ? (uintptr_t) p->value : 1;
+        }
+    }
+    uint64_t ns = host_time_ns() - start;
+
+    /* Keeps the lookups from being optimised away */
+    __asm__ volatile("" :: "r"(sum));
+    return (double) ns / ((double) rounds * count);
+}
+
+static double time_children(const struct query *queries, size_t count)
+{
+    if (!count)
+        return 0;
+
+    unsigned rounds = (MIN_LOOKUPS + count - 1) / count;
+    uintptr_t sum = 0;
+    uint64_t start = host_time_ns();
+    for (unsigned r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < count; i++)
+            sum += (uintptr_t) dt_node_find_child(queries[i].node,
+                                                  queries[i].name);
+    }
+    uint64_t ns = host_time_ns() - start;
+
+    __asm__ volatile("" :: "r"(sum));
+    return (double) ns / ((double) rounds * count);
+}
+
+int main(int argc, char **argv)
+{
+    host_seed(1);
+    mmap_add_entry((gd_memory_map_entry) {
+        .physical_start = (uintptr_t) host_memory(MEMORY_SIZE),
+        .size           = MEMORY_SIZE,
+        .type           = gd_conventional_memory,
+    });
+
+    system_fdt = argc > 1 ? read_fdt(argv[1]) : synthetic_fdt(4000);
+    CHECK(!fdt_check_header(system_fdt));
+
+    uint64_t before = arena_bytes();
+    load(system_fdt);
+
+    size_t nhits, nmisses, nchildren;
+    struct query *hits     = property_queries(system_fdt, true, &nhits);
+    struct query *misses   = property_queries(system_fdt, false, &nmisses);
+    struct query *children = child_queries(system_fdt, &nchildren);
+    check_answers(system_fdt, hits, nhits, false);
+    check_answers(system_fdt, misses, nmisses, false);
+    check_answers(system_fdt, children, nchildren, true);
+    uint64_t bytes = arena_bytes() - before;
+
+    printf("%s: %zu nodes, %zu properties\n",
+           argc > 1 ? argv[1] : "synthetic", nnodes, nproperties);
+    printf("%-24s %10" PRIu64 "\n", "memory (KiB)", bytes / 1024);
+    printf("%-24s %10.1f\n", "property found (ns)",
+           time_properties(hits, nhits));
+    printf("%-24s %10.1f\n", "property missing (ns)",
+           time_properties(misses, nmisses));
+    printf("%-24s %10.1f\n", "child (ns)",
+           time_children(children, nchildren));
+    printf("(memory is counted in whole arena chunks, once every node and "
+           "property\nhas been read in)\n");
+    return 0;
+}
@@ -0,0 +1,240 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Binds buses of synthetic devices against a few hundred synthetic drivers.
+ * Every enabled node must end up bound to the driver of the first entry of
+ * its compatible list which attaches, and the time taken per node must not
+ * grow with the number of nodes or drivers. Devices on buses which don't
+ * bind must still be probed, unless the bus is disabled.
+ */
+
+#include "host.h"
+#include <bal/device/dt.h>
+#include <bal/mmap.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (UINT64_C(256) << 20)
+#define REPEATS      3
+
+/* Bounds of the dt_drivers section, defined at link time */
+extern struct dt_driver __dt_drivers_begin[], __dt_drivers_end[];
+
+struct test_device {
+    GD_DEVICE;
+    dt_node_t node;
+};
+
+static unsigned attach_calls;
+
+static gd_device_t attach(dt_node_t node)
+{
+    struct test_device *dev = malloc(sizeof *dev);
+    CHECK(dev);
+
+    memset(dev, 0, sizeof *dev);
+    dev->node = node;
+    attach_calls++;
+    return &dev->dev;
+}
+
+static gd_device_t decline(dt_node_t node)
+{
+    (void) node;
+    return NULL;
+}
+
+/*! A bus driver which probes its devices while attaching, and then
+ *  declines
+ */
+static gd_device_t probe_and_decline(dt_node_t node)
+{
+    for (size_t i = 0; i < dt_node_child_count(node); i++)
+        CHECK(!dt_probe_node(dt_node_child(node, i)));
+    return NULL;
+}
+
+DT_DECLARE_DEVICE_DRIVER(bus_driver,     "vendor,bus",     attach)
+DT_DECLARE_DEVICE_DRIVER(decline_driver, "vendor,decline", decline)
+DT_DECLARE_DEVICE_DRIVER(failing_bus,    "vendor,failing-bus",
+                         probe_and_decline)
+
+/* 256 drivers, "vendor,dev0000" to "vendor,dev3333" */
+#define DRIVER(n) DT_DECLARE_DEVICE_DRIVER(driver_##n, "vendor,dev" #n, attach)
+#define DRIVERS4(n)  DRIVER(n##0)   DRIVER(n##1)   DRIVER(n##2)   DRIVER(n##3)
+#define DRIVERS16(n) DRIVERS4(n##0) DRIVERS4(n##1) DRIVERS4(n##2) DRIVERS4(n##3)
+#define DRIVERS64(n) DRIVERS16(n##0) DRIVERS16(n##1) DRIVERS16(n##2) \
+                     DRIVERS16(n##3)
+DRIVERS64(0) DRIVERS64(1) DRIVERS64(2) DRIVERS64(3)
+
+#define NDRIVERS 256
+
+/*! Returns the name of synthetic driver \p i */
+static void driver_name(unsigned i, char *name, size_t size)
+{
+    snprintf(name, size, "vendor,dev%u%u%u%u", i >> 6 & 3, i >> 4 & 3,
+             i >> 2 & 3, i & 3);
+}
+
+/*! Adds a bus of \p count devices under \p root. Each device lists a name
+ *  no driver has, then the declining driver for every seventh, then one of
+ *  the synthetic drivers. Every tenth is disabled.
+ */
+static dt_node_t add_bus(dt_node_t root, unsigned count)
+{
+    static unsigned buses;
+    char name[64], compatible[128];
+
+    snprintf(name, sizeof name, "bus%u", buses++);
+    dt_node_t bus = dt_node_alloc(root, name);
+    CHECK(bus);
+    CHECK(dt_node_set_property(bus, "compatible", "vendor,bus", 11));
+
+    for (unsigned i = 0; i < count; i++) {
+        snprintf(name, sizeof name, "device@%x", i);
+        dt_node_t node = dt_node_alloc(bus, name);
+        CHECK(node);
+
+        int len = snprintf(compatible, sizeof compatible, "nomatch,x%u", i) + 1;
+        if (i % 7 == 0)
+            len += snprintf(compatible + len, sizeof compatible - len,
+                            "vendor,decline") + 1;
+        driver_name(i % NDRIVERS, compatible + len, sizeof compatible - len);
+        len += strlen(compatible + len) + 1;
+        CHECK(dt_node_set_property(node, "compatible", compatible, len));
+
+        if (i % 10 == 0)
+            CHECK(dt_node_set_property(node, "status", "disabled", 9));
+    }
+    return bus;
+}
+
+/*! Probes every device of \p bus, checks how each came out, and returns the
+ *  time taken per device in nanoseconds
+ */
+static double probe_bus(dt_node_t bus)
+{
+    size_t count = dt_node_child_count(bus);
+
+    attach_calls = 0;
+    uint64_t start = host_time_ns();
+    for (size_t i = 0; i < count; i++)
+        dt_probe_node(dt_node_child(bus, i));
+    uint64_t ns = host_time_ns() - start;
+
+    /* The bus is bound along with its first device */
+    CHECK(bus->probe_state == DT_PROBE_DONE && bus->bound_device);
+    CHECK(attach_calls == 1 + count - (count + 9) / 10);
+
+    for (size_t i = 0; i < count; i++) {
+        dt_node_t node = dt_node_child(bus, i);
+        struct test_device *dev = (struct test_device *) node->bound_device;
+
+        CHECK(node->probe_state == DT_PROBE_DONE);
+        CHECK(dt_node_has_property(node, "status") ? !dev
+                                                   : dev && dev->node == node);
+    }
+    return (double) ns / count;
+}
+
+/*! Adds a bus under \p root with compatible \p compatible, and status
+ *  \p status if not NULL, and gives it three devices
+ */
+static dt_node_t add_small_bus(dt_node_t root, const char *name,
+                               const char *compatible, const char *status)
+{
+    dt_node_t bus = dt_node_alloc(root, name);
+    CHECK(bus);
+    CHECK(dt_node_set_property(bus, "compatible", compatible,
+                               strlen(compatible) + 1));
+    if (status)
+        CHECK(dt_node_set_property(bus, "status", status, strlen(status) + 1));
+
+    for (unsigned i = 0; i < 3; i++) {
+        char device[32], driver[32];
+        snprintf(device, sizeof device, "device@%u", i);
+        driver_name(i, driver, sizeof driver);
+
+        dt_node_t node = dt_node_alloc(bus, device);
+        CHECK(node);
+        CHECK(dt_node_set_property(node, "compatible", driver,
+                                   strlen(driver) + 1));
+    }
+    return bus;
+}
+
+static void test_unbound_buses(dt_node_t root)
+{
+    /* No driver: the devices are probed regardless */
+    dt_node_t bus = add_small_bus(root, "nodriver", "nomatch,bus", NULL);
+    for (size_t i = 0; i < dt_node_child_count(bus); i++) {
+        dt_node_t node = dt_node_child(bus, i);
+        CHECK(dt_probe_node(node));
+        CHECK(node->probe_state == DT_PROBE_DONE);
+    }
+    CHECK(bus->probe_state == DT_PROBE_DONE && !bus->bound_device);
+
+    /* Devices probed by the bus driver wait for it, and are probed once it
+     * has declined
+     */
+    bus = add_small_bus(root, "failing", "vendor,failing-bus", NULL);
+    CHECK(!dt_probe_node(bus));
+    for (size_t i = 0; i < dt_node_child_count(bus); i++) {
+        dt_node_t node = dt_node_child(bus, i);
+        CHECK(node->probe_state == DT_PROBE_DONE && node->bound_device);
+    }
+
+    /* A disabled bus takes its devices with it */
+    bus = add_small_bus(root, "disabled", "vendor,bus", "disabled");
+    for (size_t i = 0; i < dt_node_child_count(bus); i++) {
+        dt_node_t node = dt_node_child(bus, i);
+        CHECK(!dt_probe_node(node));
+        CHECK(node->probe_state == DT_PROBE_DONE);
+    }
+}
+
+int main(void)
+{
+    static const unsigned sizes[] = { 1000, 4000, 16000 };
+    double per_node[sizeof sizes / sizeof *sizes];
+
+    mmap_add_entry((gd_memory_map_entry) {
+        .physical_start = (uintptr_t) host_memory(MEMORY_SIZE),
+        .size           = MEMORY_SIZE,
+        .type           = gd_conventional_memory,
+    });
+    CHECK(__dt_drivers_end - __dt_drivers_begin == 3 + NDRIVERS);
+
+    dt_node_t root = dt_node_alloc(NULL, "");
+    CHECK(root);
+
+    for (size_t s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+        per_node[s] = 0;
+        for (unsigned r = 0; r < REPEATS; r++) {
+            double ns = probe_bus(add_bus(root, sizes[s]));
+            if (!r || ns < per_node[s])
+                per_node[s] = ns;
+        }
+        printf("%6u nodes, %u drivers: %.1f ns per node\n", sizes[s],
+               3 + NDRIVERS, per_node[s]);
+    }
+
+    /* Sixteen times the nodes; anything walking the nodes or drivers for
+     * each node would take sixteen times as long per node
+     */
+    CHECK(per_node[2] < 4 * per_node[0]);
+
+    test_unbound_buses(root);
+    return 0;
+}
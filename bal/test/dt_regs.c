@@ -0,0 +1,86 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Decoded reg entries must be kept across changes elsewhere in the tree, and
+ * decoded again, into the same array when it is big enough, when the node's
+ * reg or its parent's cell counts change.
+ */
+
+#include "host.h"
+#include <bal/device/dt.h>
+#include <bal/mmap.h>
+#include <libfdt.h>
+
+#define MEMORY_SIZE  (16 << 20)
+
+DT_DECLARE_DEVICE_DRIVER(unused_driver, "vendor,unused", NULL)
+
+static void set_u32(dt_node_t node, const char *name, uint32_t v)
+{
+    fdt32_t cell = cpu_to_fdt32(v);
+    CHECK(dt_node_set_property(node, name, &cell, sizeof cell));
+}
+
+/*! Sets the reg of \p node to the \p count cells from \p cells */
+static void set_reg(dt_node_t node, const uint32_t *cells, unsigned count)
+{
+    fdt32_t reg[8];
+    CHECK(count <= 8);
+    for (unsigned i = 0; i < count; i++)
+        reg[i] = cpu_to_fdt32(cells[i]);
+    CHECK(dt_node_set_property(node, "reg", reg, count * sizeof *reg));
+}
+
+int main(void)
+{
+    mmap_add_entry((gd_memory_map_entry) {
+        .physical_start = (uintptr_t) host_memory(MEMORY_SIZE),
+        .size           = MEMORY_SIZE,
+        .type           = gd_conventional_memory,
+    });
+
+    dt_node_t root = dt_node_alloc(NULL, "");
+    dt_node_t bus  = dt_node_alloc(root, "bus");
+    dt_node_t dev  = dt_node_alloc(bus, "device@1000");
+    dt_node_t peer = dt_node_alloc(bus, "device@3000");
+    CHECK(root && bus && dev && peer);
+    set_u32(bus, "#address-cells", 1);
+    set_u32(bus, "#size-cells", 1);
+    set_reg(dev, (const uint32_t[]) { 0x1000, 0x100, 0x2000, 0x200 }, 4);
+    set_reg(peer, (const uint32_t[]) { 0x3000, 0x100 }, 2);
+
+    unsigned count;
+    const struct dt_reg *regs = dt_node_get_regs(dev, &count);
+    CHECK(count == 2 && regs[1].addr == 0x2000 && regs[1].size == 0x200);
+    CHECK(dt_node_get_reg_count(peer) == 1);
+
+    /* Changes to other properties and other nodes keep it */
+    CHECK(dt_node_set_property(dev, "status", "okay", 5));
+    set_reg(peer, (const uint32_t[]) { 0x4000, 0x100 }, 2);
+    CHECK(dev->regs_valid && dt_node_get_regs(dev, &count) == regs);
+
+    /* A shorter reg is decoded into the same array */
+    set_reg(dev, (const uint32_t[]) { 0x5000, 0x80 }, 2);
+    CHECK(!dev->regs_valid && dt_node_get_regs(dev, &count) == regs);
+    CHECK(count == 1 && regs[0].addr == 0x5000 && regs[0].size == 0x80);
+
+    /* The parent's cell counts apply to all of its children */
+    set_u32(bus, "#size-cells", 0);
+    CHECK(!dev->regs_valid && !peer->regs_valid);
+    regs = dt_node_get_regs(dev, &count);
+    CHECK(count == 2 && regs[0].addr == 0x5000 && regs[1].addr == 0x80);
+    CHECK(dt_node_get_reg_count(peer) == 2);
+    return 0;
+}
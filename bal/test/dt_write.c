@@ -0,0 +1,180 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Reads a version 16 blob, whose header doesn't give the size of the
+ * structure block, and writes it back out: unchanged, with /chosen changed,
+ * and with a node added. Each time the nodes and properties must come out in
+ * the order they went in, with anything added after them.
+ */
+
+#include "host.h"
+#include <bal/device/dt.h>
+#include <bal/mmap.h>
+#include <libfdt.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (64 << 20)
+#define BLOB_SIZE    8192
+
+DT_DECLARE_DEVICE_DRIVER(unused_driver, "vendor,unused", NULL)
+
+static char blob[BLOB_SIZE], out[BLOB_SIZE];
+
+static void property_u32(void *fdt, const char *name, uint32_t v)
+{
+    fdt32_t cell = cpu_to_fdt32(v);
+    CHECK(!fdt_property(fdt, name, &cell, sizeof cell));
+}
+
+static void property_string(void *fdt, const char *name, const char *v)
+{
+    CHECK(!fdt_property(fdt, name, v, strlen(v) + 1));
+}
+
+/*! Builds the blob, describing \p memory, with properties out of name order
+ *  and then makes it version 16
+ */
+static void build_blob(uint64_t memory)
+{
+    CHECK(!fdt_create(blob, BLOB_SIZE));
+    CHECK(!fdt_finish_reservemap(blob));
+    CHECK(!fdt_begin_node(blob, ""));
+    property_u32(blob, "#address-cells", 2);
+    property_u32(blob, "#size-cells", 2);
+    property_string(blob, "model", "Write test");
+    property_string(blob, "compatible", "vendor,board");
+
+    CHECK(!fdt_begin_node(blob, "chosen"));
+    property_string(blob, "zeta", "first");
+    property_string(blob, "bootargs", "quiet");
+    property_string(blob, "alpha", "last");
+    CHECK(!fdt_end_node(blob));
+
+    CHECK(!fdt_begin_node(blob, "memory@0"));
+    property_string(blob, "device_type", "memory");
+    fdt32_t reg[4] = {
+        cpu_to_fdt32(memory >> 32), cpu_to_fdt32(memory),
+        cpu_to_fdt32(0), cpu_to_fdt32(MEMORY_SIZE),
+    };
+    CHECK(!fdt_property(blob, "reg", reg, sizeof reg));
+    CHECK(!fdt_end_node(blob));
+
+    CHECK(!fdt_begin_node(blob, "soc"));
+    property_u32(blob, "#size-cells", 1);
+    property_u32(blob, "#address-cells", 1);
+    property_string(blob, "compatible", "simple-bus");
+    CHECK(!fdt_property(blob, "ranges", NULL, 0));
+    for (unsigned i = 0; i < 4; i++) {
+        char name[32];
+        snprintf(name, sizeof name, "device@%u", 0x1000 * (4 - i));
+        CHECK(!fdt_begin_node(blob, name));
+        property_string(blob, "status", "okay");
+        property_string(blob, "compatible", "vendor,unused");
+        property_u32(blob, "interrupts", i);
+        CHECK(!fdt_end_node(blob));
+    }
+    CHECK(!fdt_end_node(blob));
+
+    CHECK(!fdt_end_node(blob));
+    CHECK(!fdt_finish(blob));
+
+    struct fdt_header *header = (struct fdt_header *) blob;
+    header->version        = cpu_to_fdt32(16);
+    header->size_dt_struct = 0;
+    CHECK(!fdt_check_header(blob));
+}
+
+/*! Checks that node \p a of \p fdt_a has the properties and subnodes of node
+ *  \p b of \p fdt_b, in the same order. The node named \p grown, if any, has
+ *  one more property at the end, and nodes may have more subnodes at the
+ *  end.
+ */
+static void check_same(const void *fdt_a, int a, const void *fdt_b, int b,
+                       const char *grown)
+{
+    const char *name = fdt_get_name(fdt_b, b, NULL);
+    CHECK(!strcmp(fdt_get_name(fdt_a, a, NULL), name));
+
+    int pa = fdt_first_property_offset(fdt_a, a);
+    int pb = fdt_first_property_offset(fdt_b, b);
+    for (; pb >= 0; pa = fdt_next_property_offset(fdt_a, pa),
+                    pb = fdt_next_property_offset(fdt_b, pb)) {
+        const char *name_a, *name_b;
+        int len_a, len_b;
+        CHECK(pa >= 0);
+        fdt_getprop_by_offset(fdt_a, pa, &name_a, &len_a);
+        fdt_getprop_by_offset(fdt_b, pb, &name_b, &len_b);
+        CHECK(!strcmp(name_a, name_b));
+    }
+    if (grown && !strcmp(name, grown)) {
+        CHECK(pa >= 0);
+        pa = fdt_next_property_offset(fdt_a, pa);
+    }
+    CHECK(pa < 0);
+
+    int ca = fdt_first_subnode(fdt_a, a), cb = fdt_first_subnode(fdt_b, b);
+    for (; cb >= 0; ca = fdt_next_subnode(fdt_a, ca),
+                    cb = fdt_next_subnode(fdt_b, cb)) {
+        CHECK(ca >= 0);
+        check_same(fdt_a, ca, fdt_b, cb, grown);
+    }
+}
+
+/*! Writes the tree out, and returns the offset of /chosen in it */
+static int write_out(void)
+{
+    size_t size = dt_fdt_size();
+    CHECK(size <= BLOB_SIZE);
+    memset(out, 0xAA, sizeof out);
+    CHECK(!dt_fdt_write(out, size));
+    CHECK(!fdt_check_header(out) && fdt_totalsize(out) == size);
+    return fdt_path_offset(out, "/chosen");
+}
+
+int main(void)
+{
+    build_blob((uintptr_t) host_memory(MEMORY_SIZE));
+    dt_platform_init_fdt(blob);
+
+    /* Unchanged, the structure block is copied as it is */
+    write_out();
+    CHECK(fdt_size_dt_struct(out) > 0);
+    CHECK(!memcmp(out + fdt_off_dt_struct(out),
+                  blob + fdt_off_dt_struct(blob), fdt_size_dt_struct(out)));
+    check_same(out, 0, blob, 0, NULL);
+
+    /* Setting a property leaves it where it was, and new ones follow */
+    dt_node_t node = dt_find_node_by_path("/chosen", 7);
+    CHECK(dt_node_set_property(node, "bootargs", "console=ttyS0", 14));
+    CHECK(dt_node_set_property(node, "linux,initrd-start", "\0\0\0\1", 4));
+    int chosen = write_out();
+    check_same(out, 0, blob, 0, "chosen");
+    CHECK(!strcmp(fdt_getprop(out, chosen, "bootargs", NULL), "console=ttyS0"));
+
+    /* A new node means writing the tree out in full, in the same order,
+     * with the new node last
+     */
+    node = dt_node_alloc(dt_find_node_by_path("/soc", 4), "device@0");
+    CHECK(node && dt_node_set_property(node, "compatible", "vendor,new", 11));
+    write_out();
+    check_same(out, 0, blob, 0, "chosen");
+
+    int last = -1;
+    for (int c = fdt_first_subnode(out, fdt_path_offset(out, "/soc")); c >= 0;
+             c = fdt_next_subnode(out, c))
+        last = c;
+    CHECK(last >= 0 && !strcmp(fdt_get_name(out, last, NULL), "device@0"));
+    return 0;
+}
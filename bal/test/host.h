@@ -0,0 +1,50 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BAL_TEST_HOST_H
+#define BAL_TEST_HOST_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Support for Bal code running as a program on the build machine. The host C
+ * library stands in for PDCLib; what it lacks, and the handful of things the
+ * Bal gets from the platform, are provided here.
+ */
+
+/*! Fails the test if \p cond is false */
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                    __FILE__, __LINE__, #cond);                             \
+            abort();                                                        \
+        }                                                                   \
+    } while (0)
+
+/*! Reserves \p size bytes of page aligned address space to stand in for
+ *  physical memory. Pages are only backed once they are touched.
+ */
+void *host_memory(size_t size);
+
+/*! Returns a monotonic time in nanoseconds */
+uint64_t host_time_ns(void);
+
+/*! Returns a pseudo-random number; the sequence depends only on the seed */
+uint64_t host_random(void);
+
+/*! Seeds host_random */
+void host_seed(uint64_t seed);
+
+#endif
@@ -0,0 +1,256 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Checks that adding entries to the memory map one at a time and as a batch
+ * give the same map, attributes included. Memory described by several entries
+ * takes the type with highest precedence, and the attributes of just those
+ * entries of that type which cover it. Freed pages keep the attributes of
+ * the memory they were in.
+ */
+
+#include "host.h"
+#include <bal/mmap.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (64 << 20)
+#define MAX_ENTRIES  64
+#define PAGE         4096
+
+static uint64_t memory;
+
+struct map {
+    gd_memory_map_entry entries[MAX_ENTRIES];
+    size_t              count;
+};
+
+static void get_map(struct map *map)
+{
+    size_t key;
+    mmap_get(map->entries, MAX_ENTRIES, &map->count, &key);
+    CHECK(map->count <= MAX_ENTRIES);
+}
+
+static void dump_map(const char *what, const struct map *map)
+{
+    fprintf(stderr, "%s:\n", what);
+    for (size_t i = 0; i < map->count; i++) {
+        const gd_memory_map_entry *e = &map->entries[i];
+        fprintf(stderr, "  %8llx + %8llx type %d attributes %llx\n",
+                (unsigned long long) (e->physical_start - memory),
+                (unsigned long long) e->size, e->type,
+                (unsigned long long) e->attributes);
+    }
+}
+
+static bool same_map(const struct map *a, const struct map *b)
+{
+    if (a->count != b->count)
+        return false;
+    for (size_t i = 0; i < a->count; i++) {
+        const gd_memory_map_entry *x = &a->entries[i], *y = &b->entries[i];
+        if (x->physical_start != y->physical_start || x->size != y->size
+                || x->type != y->type || x->attributes != y->attributes)
+            return false;
+    }
+    return true;
+}
+
+/*! Builds the map from \p count entries in a single batch */
+static void add_batch(const gd_memory_map_entry *entries, size_t count,
+                      struct map *map)
+{
+    gd_memory_map_entry copy[MAX_ENTRIES];
+    memcpy(copy, entries, count * sizeof *entries);
+
+    mmap_clean();
+    mmap_add_entries(copy, count);
+    get_map(map);
+}
+
+/*! Builds the map from \p count entries added one at a time, first to last
+ *  or, if \p reverse, last to first
+ */
+static void add_each(const gd_memory_map_entry *entries, size_t count,
+                     bool reverse, struct map *map)
+{
+    mmap_clean();
+    for (size_t i = 0; i < count; i++)
+        mmap_add_entry(entries[reverse ? count - i - 1 : i]);
+    get_map(map);
+}
+
+/*! Checks that every way of adding \p count entries gives the same map, and
+ *  returns it in \p map
+ */
+static void check_paths(const gd_memory_map_entry *entries, size_t count,
+                        struct map *map)
+{
+    struct map forward, backward;
+    add_batch(entries, count, map);
+    add_each(entries, count, false, &forward);
+    add_each(entries, count, true, &backward);
+
+    if (!same_map(map, &forward) || !same_map(map, &backward)) {
+        dump_map("batch", map);
+        dump_map("forward", &forward);
+        dump_map("backward", &backward);
+        CHECK(!"batch and sequential maps differ");
+    }
+}
+
+static gd_memory_map_entry range(uint64_t start, uint64_t size,
+                                 gd_memory_type type, uint64_t attributes)
+{
+    return (gd_memory_map_entry) {
+        .physical_start = memory + start,
+        .size           = size,
+        .type           = type,
+        .attributes     = attributes,
+    };
+}
+
+static void check_entry(const struct map *map, size_t i, uint64_t start,
+                        uint64_t size, gd_memory_type type,
+                        uint64_t attributes)
+{
+    CHECK(i < map->count);
+    CHECK(map->entries[i].physical_start == memory + start);
+    CHECK(map->entries[i].size == size);
+    CHECK(map->entries[i].type == type);
+    CHECK(map->entries[i].attributes == attributes);
+}
+
+/* A non-volatile page within conventional memory stays a page */
+static void test_attribute_island(void)
+{
+    gd_memory_map_entry entries[] = {
+        range(0, 64 << 20, gd_conventional_memory, 0),
+        range(1 << 20, PAGE, gd_conventional_memory, GD_MEMORY_NV),
+    };
+    struct map map;
+
+    check_paths(entries, 2, &map);
+    CHECK(map.count == 3);
+    check_entry(&map, 0, 0, 1 << 20, gd_conventional_memory, 0);
+    check_entry(&map, 1, 1 << 20, PAGE, gd_conventional_memory, GD_MEMORY_NV);
+    check_entry(&map, 2, (1 << 20) + PAGE, (63 << 20) - PAGE,
+                gd_conventional_memory, 0);
+}
+
+/* Overlapping entries of one type combine attributes only where they overlap */
+static void test_partial_overlap(void)
+{
+    gd_memory_map_entry entries[] = {
+        range(0, 4 * PAGE, gd_acpi_reclaim_memory, GD_MEMORY_NV),
+        range(2 * PAGE, 4 * PAGE, gd_acpi_reclaim_memory, GD_MEMORY_WB),
+    };
+    struct map map;
+
+    check_paths(entries, 2, &map);
+    CHECK(map.count == 3);
+    check_entry(&map, 0, 0, 2 * PAGE, gd_acpi_reclaim_memory, GD_MEMORY_NV);
+    check_entry(&map, 1, 2 * PAGE, 2 * PAGE, gd_acpi_reclaim_memory,
+                GD_MEMORY_NV | GD_MEMORY_WB);
+    check_entry(&map, 2, 4 * PAGE, 2 * PAGE, gd_acpi_reclaim_memory,
+                GD_MEMORY_WB);
+}
+
+/* Entries of lower precedence don't contribute attributes */
+static void test_precedence(void)
+{
+    gd_memory_map_entry entries[] = {
+        range(0, 4 * PAGE, gd_conventional_memory, GD_MEMORY_NV),
+        range(PAGE, PAGE, gd_loader_data, 0),
+        range(2 * PAGE, 4 * PAGE, gd_unusable_memory, GD_MEMORY_RUNTIME),
+    };
+    struct map map;
+
+    check_paths(entries, 3, &map);
+    CHECK(map.count == 3);
+    check_entry(&map, 0, 0, PAGE, gd_conventional_memory, GD_MEMORY_NV);
+    check_entry(&map, 1, PAGE, PAGE, gd_loader_data, 0);
+    check_entry(&map, 2, 2 * PAGE, 4 * PAGE, gd_unusable_memory,
+                GD_MEMORY_RUNTIME);
+}
+
+/* Freeing pages which span memory with different attributes gives each page
+ * back with its own
+ */
+static void test_free_across(void)
+{
+    gd_memory_map_entry entries[] = {
+        range(0, 16 * PAGE, gd_loader_data, 0),
+        range(4 * PAGE, 4 * PAGE, gd_loader_data, GD_MEMORY_NV),
+        range(8 * PAGE, 4 * PAGE, gd_loader_data, GD_MEMORY_SLOW),
+    };
+    struct map map;
+
+    add_each(entries, 3, false, &map);
+    CHECK(!gd_free_pages((void *) (uintptr_t) (memory + 2 * PAGE), 12));
+
+    get_map(&map);
+    CHECK(map.count == 6);
+    check_entry(&map, 0, 0, 2 * PAGE, gd_loader_data, 0);
+    check_entry(&map, 1, 2 * PAGE, 2 * PAGE, gd_conventional_memory, 0);
+    check_entry(&map, 2, 4 * PAGE, 4 * PAGE, gd_conventional_memory,
+                GD_MEMORY_NV);
+    check_entry(&map, 3, 8 * PAGE, 4 * PAGE, gd_conventional_memory,
+                GD_MEMORY_SLOW);
+    check_entry(&map, 4, 12 * PAGE, 2 * PAGE, gd_conventional_memory, 0);
+    check_entry(&map, 5, 14 * PAGE, 2 * PAGE, gd_loader_data, 0);
+}
+
+/* Random page aligned entries, with types and attributes from a small set so
+ * that they often coincide
+ */
+static void test_random(unsigned rounds)
+{
+    static const gd_memory_type types[] = {
+        gd_conventional_memory, gd_loader_data, gd_acpi_reclaim_memory,
+        gd_reserved_memory_type,
+    };
+    static const uint64_t attributes[] = {
+        0, GD_MEMORY_NV, GD_MEMORY_WB, GD_MEMORY_NV | GD_MEMORY_WB,
+        GD_MEMORY_RUNTIME,
+    };
+
+    for (unsigned round = 0; round < rounds; round++) {
+        gd_memory_map_entry entries[8];
+        size_t count = 1 + host_random() % 8;
+
+        for (size_t i = 0; i < count; i++) {
+            entries[i] = range(host_random() % 64 * PAGE,
+                               (1 + host_random() % 16) * PAGE,
+                               types[host_random() % 4],
+                               attributes[host_random() % 5]);
+        }
+
+        struct map map;
+        check_paths(entries, count, &map);
+    }
+}
+
+int main(void)
+{
+    memory = (uintptr_t) host_memory(MEMORY_SIZE);
+    host_seed(9);
+
+    test_attribute_island();
+    test_partial_overlap();
+    test_precedence();
+    test_free_across();
+    test_random(20000);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Measures how fast memory map operations are as the map grows. Rates should
+ * fall with the depth of the tree and no faster; a column which falls in step
+ * with the number of entries means something has gone linear.
+ */
+
+#include "host.h"
+#include <bal/mmap.h>
+#include <gd_syscall.h>
+#include <inttypes.h>
+
+#define MEMORY_SIZE  (UINT64_C(1) << 30)
+#define ROUNDS       20000
+
+static uint64_t memory;
+
+/*! Empties the map and rebuilds it as \p count entries: conventional memory
+ *  broken up by single reserved pages
+ */
+static void build_map(size_t count)
+{
+    mmap_clean();
+    mmap_add_entry((gd_memory_map_entry) {
+        .physical_start = memory,
+        .size           = MEMORY_SIZE,
+        .type           = gd_conventional_memory,
+    });
+
+    size_t holes = count / 2;
+    uint64_t stride = (MEMORY_SIZE / (holes + 1)) & ~UINT64_C(0xFFF);
+    for (size_t i = 1; i <= holes; i++) {
+        mmap_add_entry((gd_memory_map_entry) {
+            .physical_start = memory + i * stride,
+            .size           = 4096,
+            .type           = gd_unusable_memory,
+        });
+    }
+}
+
+static size_t map_size(void)
+{
+    size_t needed, key;
+    mmap_get(NULL, 0, &needed, &key);
+    return needed;
+}
+
+/*! Operations per second, given that \p rounds took \p ns nanoseconds */
+static double rate(unsigned rounds, uint64_t ns)
+{
+    return ns ? rounds * 1e9 / ns : 0;
+}
+
+/*! Adds single pages of conventional memory at random. They lie within
+ *  conventional memory or a reserved page, so the map keeps its shape.
+ */
+static double insert(void)
+{
+    uint64_t start = host_time_ns();
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        mmap_add_entry((gd_memory_map_entry) {
+            .physical_start = memory + host_random() % MEMORY_SIZE / 4096 * 4096,
+            .size           = 4096,
+            .type           = gd_conventional_memory,
+        });
+    }
+    return rate(ROUNDS, host_time_ns() - start);
+}
+
+/*! Allocates and then frees a page, below a randomly chosen limit if
+ *  \p bounded, and returns the rate of each in \p *alloc and \p *free
+ */
+static void alloc_free(bool bounded, double *alloc, double *free)
+{
+    uint64_t alloc_ns = 0, free_ns = 0;
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        uint64_t max = memory + MEMORY_SIZE - 1;
+        if (bounded)
+            max = memory + host_random() % MEMORY_SIZE;
+
+        void *p;
+        uint64_t t0 = host_time_ns();
+        int err = gd_alloc_pages_constrained(gd_loader_data, &p, 1, 4096,
+                                             memory, max, 0);
+        uint64_t t1 = host_time_ns();
+        if (err)
+            continue;
+
+        gd_free_pages(p, 1);
+        free_ns  += host_time_ns() - t1;
+        alloc_ns += t1 - t0;
+    }
+    *alloc = rate(ROUNDS, alloc_ns);
+    *free  = rate(ROUNDS, free_ns);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 32, 1000, 10000 };
+
+    memory = (uintptr_t) host_memory(MEMORY_SIZE);
+    host_seed(1);
+
+    printf("thousands of operations per second\n");
+    printf("%8s %8s %8s %8s %8s %8s\n", "entries", "insert", "alloc", "free",
+           "alloc<", "free<");
+    for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+        build_map(sizes[i]);
+        CHECK(map_size() >= sizes[i]);
+
+        double inserts = insert();
+        CHECK(map_size() >= sizes[i] && map_size() <= sizes[i] + 8);
+
+        double alloc, free, bounded_alloc, bounded_free;
+        alloc_free(false, &alloc, &free);
+        alloc_free(true, &bounded_alloc, &bounded_free);
+        printf("%8zu %8.0f %8.0f %8.0f %8.0f %8.0f\n", map_size(),
+               inserts / 1000, alloc / 1000, free / 1000,
+               bounded_alloc / 1000, bounded_free / 1000);
+    }
+    printf("(alloc< and free< allocate below a random limit)\n");
+    return 0;
+}
@@ -0,0 +1,61 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Uses up the memory map's static entries on a map with no free memory to
+ * hold more. Allocating and freeing must then fail with ENOMEM, leaving the
+ * map as it was, rather than bring the loader down.
+ */
+
+#include "host.h"
+#include <bal/mmap.h>
+#include <errno.h>
+#include <string.h>
+
+/* The number of entries the memory map starts with */
+#define STATIC_ENTRIES  32
+#define PAGE            4096
+
+int main(void)
+{
+    gd_memory_map_entry before[STATIC_ENTRIES + 1], after[STATIC_ENTRIES + 1];
+    size_t count, key;
+
+    /* Separate ranges of loader data, each needing an entry of its own.
+     * The addresses are never touched.
+     */
+    for (uint64_t i = 0; i < STATIC_ENTRIES; i++) {
+        mmap_add_entry((gd_memory_map_entry) {
+            .type           = gd_loader_data,
+            .physical_start = (i + 1) * 0x100000,
+            .virtual_start  = (i + 1) * 0x100000,
+            .size           = 4 * PAGE,
+        });
+    }
+    mmap_get(before, STATIC_ENTRIES + 1, &count, &key);
+    CHECK(count == STATIC_ENTRIES);
+
+    void *p;
+    CHECK(gd_alloc_pages(gd_loader_data, &p, 1) == ENOMEM);
+    CHECK(gd_alloc_pages_constrained(gd_loader_data, &p, 1, PAGE, 0,
+                                     UINT64_MAX, 0) == ENOMEM);
+
+    /* Freeing the middle of a range would split its entry */
+    CHECK(gd_free_pages((void *) (uintptr_t) (0x100000 + PAGE), 1) == ENOMEM);
+
+    size_t count_after;
+    mmap_get(after, STATIC_ENTRIES + 1, &count_after, &key);
+    CHECK(count_after == count && !memcmp(before, after, count * sizeof *after));
+    return 0;
+}
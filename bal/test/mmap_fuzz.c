@@ -0,0 +1,252 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Drives the memory map with a random mix of insertions, allocations and
+ * frees, checking after every step that the map is sorted, non-overlapping,
+ * merged and page aligned, and that every live allocation is still where it
+ * was put and described as what it was allocated as.
+ *
+ * Usage: mmap_fuzz [seed [steps]]
+ */
+
+#include "host.h"
+#include <bal/mmap.h>
+#include <gd_syscall.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define MEMORY_SIZE  (UINT64_C(256) << 20)
+#define MAX_ENTRIES  (1 << 16)
+#define MAX_LIVE     512
+#define PAGE         4096
+
+static uint64_t memory;
+
+static gd_memory_map_entry map[MAX_ENTRIES];
+static size_t map_count;
+
+struct allocation {
+    uint64_t       start;
+    size_t         count;
+    gd_memory_type type;
+};
+
+static struct allocation live[MAX_LIVE];
+static size_t nlive;
+
+static void dump_map(void)
+{
+    for (size_t i = 0; i < map_count; i++) {
+        fprintf(stderr, "  %10" PRIx64 " + %10" PRIx64 " type %2d attributes %"
+                PRIx64 "\n", map[i].physical_start - memory, map[i].size,
+                map[i].type, map[i].attributes);
+    }
+}
+
+#define CHECK_MAP(cond) do { if (!(cond)) dump_map(); CHECK(cond); } while (0)
+
+/*! Returns the index of the entry containing \p addr, or map_count */
+static size_t map_find(uint64_t addr)
+{
+    size_t lo = 0, hi = map_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map[mid].physical_start + map[mid].size <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < map_count && map[lo].physical_start <= addr)
+        return lo;
+    return map_count;
+}
+
+static void check_invariants(void)
+{
+    size_t key;
+    mmap_get(map, MAX_ENTRIES, &map_count, &key);
+    CHECK(map_count <= MAX_ENTRIES);
+
+    for (size_t i = 0; i < map_count; i++) {
+        const gd_memory_map_entry *e = &map[i];
+        CHECK_MAP(e->size && !(e->size & (PAGE - 1)));
+        CHECK_MAP(!(e->physical_start & (PAGE - 1)));
+        if (!i)
+            continue;
+
+        const gd_memory_map_entry *p = &map[i - 1];
+        CHECK_MAP(p->physical_start + p->size <= e->physical_start);
+        CHECK_MAP(p->physical_start + p->size < e->physical_start
+                  || p->type != e->type || p->attributes != e->attributes);
+    }
+
+    for (size_t i = 0; i < nlive; i++) {
+        uint64_t start = live[i].start, end = start + live[i].count * PAGE;
+        while (start < end) {
+            size_t n = map_find(start);
+            CHECK_MAP(n < map_count && map[n].type == live[i].type);
+            start = map[n].physical_start + map[n].size;
+        }
+    }
+}
+
+static uint64_t random_below(uint64_t n)
+{
+    return host_random() % n;
+}
+
+static gd_memory_map_entry random_entry(gd_memory_type type, uint64_t pages)
+{
+    static const uint64_t attributes[] = {
+        0, 0, 0, GD_MEMORY_WB, GD_MEMORY_NV, GD_MEMORY_SLOW,
+    };
+    uint64_t start = random_below(MEMORY_SIZE / PAGE) * PAGE;
+    uint64_t size  = (1 + random_below(pages)) * PAGE;
+    if (size > MEMORY_SIZE - start)
+        size = MEMORY_SIZE - start;
+
+    return (gd_memory_map_entry) {
+        .physical_start = memory + start,
+        .size           = size,
+        .type           = type,
+        .attributes     = attributes[random_below(6)],
+    };
+}
+
+/* Insertions use types which lose to loader data, so that they don't take
+ * away memory which has been allocated. Boot services data is never freed, so
+ * keep it small.
+ */
+static void step_insert(void)
+{
+    gd_memory_map_entry batch[16];
+    size_t count = random_below(2) ? 1 : 1 + random_below(16);
+
+    for (size_t i = 0; i < count; i++) {
+        if (random_below(8))
+            batch[i] = random_entry(gd_conventional_memory, 4096);
+        else
+            batch[i] = random_entry(gd_boot_services_data, 16);
+    }
+
+    if (count == 1)
+        mmap_add_entry(batch[0]);
+    else
+        mmap_add_entries(batch, count);
+}
+
+static void step_alloc(void)
+{
+    if (nlive == MAX_LIVE)
+        return;
+
+    size_t   count = 1 + random_below(random_below(8) ? 8 : 512);
+    uint64_t align = (uint64_t) PAGE << random_below(10);
+    uint64_t min   = memory + random_below(MEMORY_SIZE / 2);
+    uint64_t max   = min + random_below(MEMORY_SIZE - (min - memory));
+    unsigned flags = 0;
+    if (random_below(2))
+        flags |= GD_ALLOC_BOTTOM_UP;
+    if (random_below(2))
+        flags |= GD_ALLOC_ZEROED;
+    if (!random_below(4)) {
+        min = 0;
+        max = UINT64_MAX;
+    }
+
+    void *p;
+    if (gd_alloc_pages_constrained(gd_loader_data, &p, count, align, min, max,
+                                   flags))
+        return;
+
+    uint64_t start = (uintptr_t) p;
+    CHECK(!(start & (align - 1)));
+    CHECK(start >= min && start + count * PAGE - 1 <= max);
+    CHECK(start >= memory && start + count * PAGE <= memory + MEMORY_SIZE);
+    for (size_t i = 0; i < nlive; i++) {
+        CHECK(start + count * PAGE <= live[i].start
+              || live[i].start + live[i].count * PAGE <= start);
+    }
+
+    /* Leave something behind in every page, so that memory which is later
+     * handed out zeroed must really have been zeroed.
+     */
+    for (size_t i = 0; i < count; i++) {
+        uint64_t *page = (uint64_t*) (uintptr_t) (start + i * PAGE);
+        if (flags & GD_ALLOC_ZEROED) {
+            for (size_t j = 0; j < PAGE / sizeof *page; j++)
+                CHECK(page[j] == 0);
+        }
+        page[i % (PAGE / sizeof *page)] = start;
+    }
+
+    live[nlive++] = (struct allocation) { start, count, gd_loader_data };
+}
+
+static void step_free(void)
+{
+    if (!nlive)
+        return;
+
+    struct allocation *a = &live[random_below(nlive)];
+
+    /* Sometimes only give back the head of the allocation */
+    size_t count = a->count;
+    if (count > 1 && !random_below(4))
+        count = 1 + random_below(count - 1);
+
+    CHECK(gd_free_pages((void*) (uintptr_t) a->start, count) == 0);
+    a->start += count * PAGE;
+    a->count -= count;
+    if (!a->count)
+        *a = live[--nlive];
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed  = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+    unsigned steps = argc > 2 ? strtoul(argv[2], NULL, 0) : 20000;
+
+    memory = (uintptr_t) host_memory(MEMORY_SIZE);
+    host_seed(seed);
+
+    mmap_add_entry((gd_memory_map_entry) {
+        .physical_start = memory,
+        .size           = MEMORY_SIZE,
+        .type           = gd_conventional_memory,
+    });
+    for (unsigned i = 0; i < 64; i++)
+        step_insert();
+    check_invariants();
+
+    for (unsigned i = 0; i < steps; i++) {
+        switch (random_below(8)) {
+        case 0:
+            step_insert();
+            break;
+        case 1: case 2: case 3: case 4:
+            step_alloc();
+            break;
+        default:
+            step_free();
+            break;
+        }
+        check_invariants();
+    }
+
+    printf("mmap_fuzz: seed %" PRIu64 ", %u steps, %zu entries at end\n",
+           seed, steps, map_count);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PAGE_ARCH_H
+#define PAGE_ARCH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Page operations for AArch64 */
+
+/*! Returns true if the data cache is on at the current exception level.
+ *  DC ZVA faults on Device memory, which is what everything is with the
+ *  MMU or caches off.
+ */
+static inline int page_cache_enabled(void)
+{
+    uint64_t el, sctlr;
+    __asm volatile( "mrs %0, CurrentEL" : "=r"(el) );
+    switch ((el >> 2) & 3) {
+    case 3:  __asm volatile( "mrs %0, sctlr_el3" : "=r"(sctlr) ); break;
+    case 2:  __asm volatile( "mrs %0, sctlr_el2" : "=r"(sctlr) ); break;
+    default: __asm volatile( "mrs %0, sctlr_el1" : "=r"(sctlr) ); break;
+    }
+    /* M and C */
+    return (sctlr & 5) == 5;
+}
+
+/*! Zeroes \p size bytes at \p start, both of which are page aligned.
+ *
+ *  DC ZVA clears a whole block (at most 2KiB, so pages are always a whole
+ *  number of them) without reading it in first. It is prohibited when
+ *  DCZID_EL0.DZP is set, in which case we fall back to memset.
+ */
+static inline void page_zero(void *start, size_t size)
+{
+    uint64_t dczid;
+    __asm volatile( "mrs %0, dczid_el0" : "=r"(dczid) );
+    if ((dczid & (1 << 4)) || !page_cache_enabled()) {
+        memset(start, 0, size);
+        return;
+    }
+
+    size_t block = (size_t) 4 << (dczid & 0xF);
+    for (char *p = start, *end = p + size; p < end; p += block)
+        __asm volatile( "dc zva, %0" : : "r"(p) : "memory" );
+}
+
+#endif
@@ -0,0 +1,41 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PAGE_ARCH_H
+#define PAGE_ARCH_H
+#include <stddef.h>
+
+/* Page operations for x86 */
+
+/*! Zeroes \p size bytes at \p start, both of which are page aligned.
+ *
+ *  Fast string microcode turns a long rep stos into full cache line writes,
+ *  and on parts with ERMS it is the fastest way to clear memory there is.
+ */
+static inline void page_zero(void *start, size_t size)
+{
+#ifdef __x86_64__
+    size_t count = size / 8;
+    __asm volatile( "rep stosq"
+                  : "+D"(start), "+c"(count) : "a"(0) : "memory" );
+#else
+    size_t count = size / 4;
+    __asm volatile( "rep stosl"
+                  : "+D"(start), "+c"(count) : "a"(0) : "memory" );
+#endif
+}
+
+#endif
@@ -0,0 +1,49 @@
+/* Copyright © 2014, Owen Shepherd & Shikhin Sethi
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BAL_ARENA_H
+#define BAL_ARENA_H
+#include <stddef.h>
+#include <stdint.h>
+
+struct arena_chunk;
+
+/*! A region which objects are allocated from one after another, and which is
+ *  only ever released as a whole.
+ *
+ *  Arenas take their pages from the memory map as boot services data, so
+ *  whatever is still in one when the loader exits is given back along with
+ *  the rest of the loader's boot time memory, without being walked.
+ */
+struct arena {
+    struct arena_chunk *chunks;
+    uintptr_t           next;
+    uintptr_t           end;
+};
+
+#define ARENA_INITIALIZER { NULL, 0, 0 }
+
+/*! Allocates \p size bytes aligned to \p align, which must be a power of two,
+ *  from \p arena. Returns NULL if no memory could be had.
+ */
+void *arena_alloc(struct arena *arena, size_t size, size_t align);
+
+/*! Copies the string \p str into \p arena */
+char *arena_strdup(struct arena *arena, const char *str);
+
+/*! Frees everything allocated from \p arena, which may then be reused */
+void arena_release(struct arena *arena);
+
+#endif
@@ -17,9 +17,28 @@
 #include <bal/device/bus.h>
 #include <bal/device/dt.h>
 
+/*! A window from addresses on a bus onto CPU physical addresses */
+struct simple_bus_range {
+    uint64_t bus_addr;
+    uint64_t cpu_addr;
+    uint64_t size;
+};
+
 struct simple_bus_dev {
     GD_DEVICE;
     dt_node_t        node;
+    /*! Addresses on the bus are CPU physical addresses */
+    bool                     identity;
+    /*! Otherwise, the windows given by ranges, sorted by bus address and
+     *  already translated through every bus above this one
+     */
+    struct simple_bus_range *ranges;
+    unsigned                 range_count;
+    /*! Addresses on the bus are those of the parent, which isn't a
+     *  simple-bus, so they are translated through the ranges of the nodes
+     *  above on each lookup
+     */
+    bool                     through_parent;
 };
 
 #endif
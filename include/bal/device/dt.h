@@ -16,33 +16,193 @@
 #ifndef BAL_DEVICE_DT_H
 #define BAL_DEVICE_DT_H
 #include <gd_bal.h>
-#include <gd_tree.h>
+
+/*! An entry in a sorted array of named children or properties. The hash of
+ *  the name is kept alongside, so a lookup compares integers and only
+ *  touches strings on a hash match.
+ */
+struct dt_slot {
+    uint32_t    hash;
+    const char *name;
+    void       *item;
+};
+
+/*! Slots sorted by hash, then name */
+struct dt_slots {
+    struct dt_slot *slots;
+    uint32_t        count;
+    uint32_t        capacity;
+};
+
+struct arena;
+
+/*! The start of every slot of a dt_hash_table. A NULL key marks an empty
+ *  slot.
+ */
+struct dt_hash_slot {
+    const void *key;
+    uint32_t    hash;
+};
+
+/*! Compares \p key, as passed to dt_hash_find or dt_hash_insert, with the
+ *  key of a slot of the same hash
+ */
+typedef bool (*dt_hash_match)(const void *key, const void *slot_key);
+
+/*! An open addressed hash table, kept at most half full. Slots are
+ *  \p slot_size bytes, each starting with a struct dt_hash_slot followed by
+ *  whatever the user keeps with the key. The table doubles in \p arena as it
+ *  fills, and lives as long as the arena does.
+ */
+struct dt_hash_table {
+    void          *slots;
+    uint32_t       capacity;
+    uint32_t       count;
+    size_t         slot_size;
+    struct arena  *arena;
+    /*! NULL if keys are compared by pointer */
+    dt_hash_match  match;
+};
+
+#define DT_HASH_TABLE_INITIALIZER(slot_type, arena, match) \
+    { NULL, 0, 0, sizeof (slot_type), (arena), (match) }
+
+/*! Returns the slot of \p table holding \p key, or NULL */
+void *dt_hash_find(const struct dt_hash_table *table, const void *key,
+                   uint32_t hash);
+/*! Returns the slot of \p table holding \p key or, if there isn't one, an
+ *  empty slot which the caller must fill in, key included. Returns NULL if
+ *  the table needs to grow and there is no memory.
+ */
+void *dt_hash_insert(struct dt_hash_table *table, const void *key,
+                     uint32_t hash);
+
+/*! Returns slot \p i of \p table, for walking every slot */
+static inline void *dt_hash_slot_at(const struct dt_hash_table *table,
+                                    uint32_t i)
+{
+    return (char *) table->slots + i * table->slot_size;
+}
+
+/*! An interned name. Every node and property name in the tree is interned,
+ *  so names can be compared by comparing their atoms.
+ */
+struct dt_atom {
+    uint32_t    hash;
+    const char *name;
+};
+typedef const struct dt_atom *dt_atom_t;
+
+/* Atoms for commonly used property names, interned before any other */
+extern struct dt_atom dt_atom_compatible;
+extern struct dt_atom dt_atom_reg;
+extern struct dt_atom dt_atom_ranges;
+extern struct dt_atom dt_atom_address_cells;
+extern struct dt_atom dt_atom_size_cells;
+extern struct dt_atom dt_atom_status;
+extern struct dt_atom dt_atom_interrupts;
+extern struct dt_atom dt_atom_phandle;
+
+/*! Returns the atom for \p name, interning a copy of it if needed */
+dt_atom_t     dt_intern(const char *name);
+/*! Returns the atom for \p name, which is referenced rather than copied and
+ *  must stay valid for the life of the tree
+ */
+dt_atom_t     dt_intern_borrowed(const char *name);
+/*! Returns the atom for \p name, or NULL if it has never been interned */
+dt_atom_t     dt_atom_lookup(const char *name);
 
 typedef struct dt_property {
-    RB_ENTRY(dt_property) rbnode;
     size_t value_len;
     const char * name;
     void *value;
+    /*! The name and value point into memory the tree doesn't own, such as
+     *  the FDT blob. The value is copied before it is first modified.
+     */
+    bool borrowed;
+    /*! Where the property comes among those of its node: the ones from the
+     *  FDT in the order they are there, then the rest in the order they were
+     *  added
+     */
+    uint32_t order;
 } *dt_property_t;
 
+/*! An entry of a reg property, in the address space of the parent bus */
+struct dt_reg {
+    uint64_t addr;
+    uint64_t size;
+};
+
+/*! Where a node is in being bound to a driver */
+enum dt_probe_state {
+    /*! Not looked at yet */
+    DT_PROBE_NONE = 0,
+    /*! bound_device is a stand in; the driver attaches on its first ioctl */
+    DT_PROBE_LAZY,
+    /*! Attaching now */
+    DT_PROBE_ACTIVE,
+    /*! Waiting for the probe of the parent bus to finish */
+    DT_PROBE_DEFERRED,
+    /*! Probed, whether or not a driver attached */
+    DT_PROBE_DONE,
+};
+
+/*! A device tree node. The properties of nodes which come from the FDT are
+ *  only read in when first looked at, so go through the dt_node_* functions
+ *  rather than using \p properties directly.
+ */
 typedef struct dt_node {
-    RB_ENTRY(dt_node)                    rbnode;
-    RB_HEAD(dt_nodes, dt_node)           children;
-    RB_HEAD(dt_properties, dt_property)  properties;
+    struct dt_slots                      children;
+    struct dt_slots                      properties;
     struct dt_node                      *parent;
     gd_device_t                          bound_device;
     const char                          *name;
+    /*! Full path of the node, such as "/soc/uart@1000" */
+    const char                          *path;
+    size_t                               path_len;
+    /*! Offset of the node in system_fdt, or -1 if it didn't come from there */
+    int                                  fdt_offset;
+    /*! The properties have yet to be read from system_fdt */
+    bool                                 lazy_properties;
+    /*! An enum dt_probe_state */
+    uint8_t                              probe_state;
+    /*! Next node in the list waiting for their parents to be bound */
+    struct dt_node                      *deferred_next;
+    /*! The node has been changed since it was read from system_fdt, or
+     *  didn't come from there; see dt_dirty_nodes
+     */
+    bool                                 dirty;
+    struct dt_node                      *dirty_next;
+    /*! reg, decoded when first asked for; see dt_node_get_regs. The array
+     *  has room for \p reg_capacity entries, and is reused when reg is
+     *  decoded again.
+     */
+    struct dt_reg                       *regs;
+    uint32_t                             reg_count;
+    uint32_t                             reg_capacity;
+    /*! \p regs is up to date with reg and the parent's cell counts */
+    bool                                 regs_valid;
 } *dt_node_t;
 
-int dt_property_cmp(dt_property_t lhs, dt_property_t rhs);
-int dt_node_cmp(dt_node_t lhs, dt_node_t rhs);
+extern void *system_fdt;
 
-RB_PROTOTYPE(dt_properties, dt_property, rbnode, dt_property_cmp)
-RB_PROTOTYPE(dt_nodes,      dt_node,     rbnode, dt_node_cmp)
+/*! Nodes which have been changed, linked through dirty_next. Adding a child
+ *  changes the parent as well as the child.
+ */
+extern dt_node_t dt_dirty_nodes;
+/*! Count of changes made to the tree */
+extern uint32_t  dt_change_count;
 
 dt_node_t     dt_node_alloc(dt_node_t parent, const char *name);
+dt_node_t     dt_node_alloc_fdt(dt_node_t parent, int offset);
+/* Children and properties, in no particular order */
+size_t        dt_node_child_count(dt_node_t node);
+dt_node_t     dt_node_child(dt_node_t node, size_t idx);
+size_t        dt_node_property_count(dt_node_t node);
+dt_property_t dt_node_property(dt_node_t node, size_t idx);
 dt_node_t     dt_node_find_child(dt_node_t parent, const char *name);
 dt_property_t dt_node_find_property(dt_node_t node, const char *name);
+dt_property_t dt_node_find_property_atom(dt_node_t node, dt_atom_t name);
 bool          dt_node_has_property(dt_node_t node, const char *name);
 const void   *dt_node_get_property(dt_node_t node, const char *name);
 dt_property_t dt_node_set_property(
@@ -50,6 +210,11 @@ dt_property_t dt_node_set_property(
     const char *name,
     const void *value,
     size_t      len);
+dt_property_t dt_node_borrow_property(
+    dt_node_t   node,
+    const char *name,
+    const void *value,
+    size_t      len);
 bool          dt_node_get_reg_range(
     dt_node_t  node,
     unsigned   idx,
@@ -58,11 +223,54 @@ bool          dt_node_get_reg_range(
 
 unsigned      dt_node_get_reg_count(
     dt_node_t  node);
+/*! Returns the entries of the reg property of \p node, decoded using the
+ *  #address-cells and #size-cells of its parent, and sets \p count to how
+ *  many there are. They are decoded once and kept until reg or the parent's
+ *  #address-cells or #size-cells is changed.
+ */
+const struct dt_reg *dt_node_get_regs(dt_node_t node, unsigned *count);
 uint32_t      dt_node_get_address_cells(dt_node_t node);
 uint32_t      dt_node_get_size_cells(dt_node_t node);
 uint32_t      dt_property_get_uint32(dt_property_t prop);
 uint64_t      dt_property_get_uint64(dt_property_t prop);
+/*! Reads the big endian number \p count cells long at \p cells, which needn't
+ *  be aligned. Panics if it is more than 2 cells long.
+ */
+uint64_t      dt_read_cells(const void *cells, unsigned count);
 dt_node_t     dt_root_node(void);
+/*! Returns the node with full path \p path, which is \p len bytes long, or
+ *  NULL
+ */
+dt_node_t     dt_find_node_by_path(const char *path, size_t len);
+
+/*! A list of nodes, in the order they appear in the FDT */
+struct dt_node_list {
+    dt_node_t                  node;
+    const struct dt_node_list *next;
+};
+
+/*! Returns the node with phandle \p phandle, or NULL */
+dt_node_t     dt_find_by_phandle(uint32_t phandle);
+/*! Returns the nodes with \p compatible in their compatible lists, or NULL */
+const struct dt_node_list *dt_find_compatible(const char *compatible);
+/*! Adds \p node to the phandle index */
+void          dt_index_phandle(uint32_t phandle, dt_node_t node);
+/*! Adds \p node to the compatible index under \p compatible, which must stay
+ *  valid for the life of the tree
+ */
+void          dt_index_compatible(const char *compatible, dt_node_t node);
+/*! Returns the largest phandle in the tree */
+uint32_t      dt_max_phandle(void);
+
+/*! Applies the device tree overlay blob \p overlay to the tree, resolving
+ *  its references against the tree's __symbols__. Returns EINVAL if the
+ *  overlay is malformed or nested too deeply and ENOENT if it refers to
+ *  something which isn't there; the tree is untouched in either case.
+ *  Returns ENOMEM if memory runs out, which can happen part way through and
+ *  leave the overlay partly applied. Nodes the overlay adds are probed by
+ *  the next dt_probe_all.
+ */
+int           dt_overlay_apply(const void *overlay);
 
 typedef gd_device_t (*dt_driver_attach)(dt_node_t node);
 
@@ -83,7 +291,28 @@ struct dt_driver sym \
     __attribute__((section("dt_drivers"), unused)) = \
     { name, func };
 
+/*! Binds \p node to the driver for the first entry of its compatible list
+ *  which has one and attaches, probing its parents first, and returns the
+ *  bound device. Returns NULL if nothing attaches, the node or its parent
+ *  bus is disabled, or the parent is still being probed; in the last case it
+ *  is tried again once the parent's probe finishes. A node whose parent has
+ *  no driver is probed regardless.
+ */
+gd_device_t dt_probe_node(dt_node_t node);
+/*! Probes the /chosen stdout-path device and the buses it sits on, then
+ *  gives every other node with a driver a stand in device which attaches
+ *  the driver on first use
+ */
+void        dt_probe_all(void);
+
 int dt_base_ioctl(gd_device_t dev, unsigned ioctl, va_list *pap);
 void dt_platform_init_fdt(void *fdt);
 
+/*! Returns the exact size of the FDT blob dt_fdt_write will produce */
+size_t dt_fdt_size(void);
+/*! Writes the tree out as an FDT blob into \p buf, which is \p size bytes.
+ *  Returns ENOSPC if the blob doesn't fit.
+ */
+int    dt_fdt_write(void *buf, size_t size);
+
 #endif
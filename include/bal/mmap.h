@@ -17,9 +17,51 @@
 #define BAL_MMAP_H
 #include <gd_bal.h>
 
-/*! Add an entry to the memory map */
+/*! Add an entry to the memory map
+ *
+ * Where entries overlap, the type with higher precedence wins. The memory
+ * keeps the attributes of the entries of that type which describe it, and
+ * only those.
+ */
 void mmap_add_entry(gd_memory_map_entry entry);
 
+/*! Add a batch of entries to the memory map
+ *
+ * The whole batch is merged into the map in a single pass, with overlaps
+ * resolved exactly as mmap_add_entry would. This is considerably cheaper than
+ * adding entries one at a time when building the map from firmware tables.
+ *
+ * \param entries    entries to add; sorted in place
+ * \param count      number of entries
+ */
+void mmap_add_entries(gd_memory_map_entry *entries, size_t count);
+
+/*! Record that a range of memory belongs to a NUMA proximity domain
+ *
+ * Node ranges are kept apart from the memory map proper; they say where
+ * memory is, not what it is used for. Ranges added later take precedence
+ * where they overlap earlier ones.
+ *
+ * \param start      physical start address
+ * \param size       size in bytes
+ * \param domain     proximity domain
+ */
+void mmap_add_node_range(uint64_t start, uint64_t size, uint32_t domain);
+
+/*! Returns the proximity domain of \p addr in \p *domain, or false if it
+ *  isn't known
+ */
+bool mmap_node_of(uint64_t addr, uint32_t *domain);
+
+/*! Writes the recorded node ranges into a newly allocated gd_memory_node_table
+ *
+ * As this allocates from the memory map, call it before mmap_export.
+ *
+ * \param *ptable     receives the table, or NULL if there are no node ranges
+ * \return 0 on success, or ENOMEM
+ */
+int mmap_export_nodes(gd_memory_node_table **ptable);
+
 /*! Empty the memory map */
 void mmap_clean(void);
 
@@ -36,4 +78,22 @@ void mmap_get(
     size_t *needed,
     size_t *key);
 
+/*! Writes the memory map into a newly allocated gd_memory_map_table
+ *
+ * The table is allocated from the memory map as loader data, with room for
+ * the entries which allocating it may add, and then filled in straight from
+ * the map. The table therefore describes the map including itself, and \p key
+ * remains valid until something else changes the map.
+ *
+ * \param *ptable     receives the table
+ * \param *key        key of the map described by the table
+ * \return 0 on success, or ENOMEM
+ */
+int mmap_export(gd_memory_map_table **ptable, size_t *key);
+
+/*! Returns true if the memory map has changed since \p key was obtained
+ *  from mmap_get or mmap_export
+ */
+bool mmap_changed_since(size_t key);
+
 #endif
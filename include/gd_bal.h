@@ -37,6 +37,32 @@ typedef struct gd_device {
         int (*ioctl)(struct gd_device *, unsigned, ...); \
     }
 
+/*! Placement flags for gd_alloc_pages_constrained */
+enum {
+    /*! Allocate from the lowest suitable address, rather than the highest.
+     *  Top down placement is the default as it keeps low memory, which
+     *  firmware and legacy devices often require, available.
+     */
+    GD_ALLOC_BOTTOM_UP = (1 << 0),
+
+    /*! Only allocate from memory in the proximity domain given with
+     *  GD_ALLOC_NODE, rather than falling back to any node
+     */
+    GD_ALLOC_NODE_STRICT = (1 << 1),
+
+    /*! Return zeroed memory. Memory which is already known to be zero is
+     *  not cleared again.
+     */
+    GD_ALLOC_ZEROED = (1 << 2),
+};
+
+/*! Placement flag requesting memory in NUMA proximity domain \p n. This is a
+ *  hint unless GD_ALLOC_NODE_STRICT is also given.
+ */
+#define GD_ALLOC_NODE(n)         ((((unsigned) (n)) + 1) << 8)
+#define GD_ALLOC_HAS_NODE(flags) (((flags) >> 8) != 0)
+#define GD_ALLOC_NODE_OF(flags)  (((flags) >> 8) - 1)
+
 int (*gd_syscall_p)(unsigned, ...);
 int gd_ioctl(gd_device_t, unsigned, ...);
 int gd_syscall(unsigned, ...);
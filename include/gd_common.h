@@ -93,6 +93,42 @@ typedef enum {
     gd_memory_force_size = INT_MAX
 } gd_memory_type;
 
+/*! Memory map entry attribute bits.
+ *
+ *  Bits 0 - 47 and 63 are taken from the UEFI specification. Bits 48 - 62 are
+ *  Gandr defined
+ */
+typedef uint64_t gd_memory_map_attribute;
+
+/*! Uncacheable */
+#define GD_MEMORY_UC            ((gd_memory_map_attribute) 1 << 0)
+/*! Write combining */
+#define GD_MEMORY_WC            ((gd_memory_map_attribute) 1 << 1)
+/*! Write through */
+#define GD_MEMORY_WT            ((gd_memory_map_attribute) 1 << 2)
+/*! Write back */
+#define GD_MEMORY_WB            ((gd_memory_map_attribute) 1 << 3)
+/*! Uncacheable, exported, supporting the "fetch and add" semaphore mechanism */
+#define GD_MEMORY_UCE           ((gd_memory_map_attribute) 1 << 4)
+/*! Write protected */
+#define GD_MEMORY_WP            ((gd_memory_map_attribute) 1 << 12)
+/*! Read protected */
+#define GD_MEMORY_RP            ((gd_memory_map_attribute) 1 << 13)
+/*! Execute protected */
+#define GD_MEMORY_XP            ((gd_memory_map_attribute) 1 << 14)
+/*! Persistent (non-volatile) memory */
+#define GD_MEMORY_NV            ((gd_memory_map_attribute) 1 << 15)
+/*! Higher reliability than other memory in the system */
+#define GD_MEMORY_MORE_RELIABLE ((gd_memory_map_attribute) 1 << 16)
+/*! Read only */
+#define GD_MEMORY_RO            ((gd_memory_map_attribute) 1 << 17)
+/*! Memory which firmware has set aside for a specific purpose */
+#define GD_MEMORY_SP            ((gd_memory_map_attribute) 1 << 18)
+/*! Slower to access than other memory in the system */
+#define GD_MEMORY_SLOW          ((gd_memory_map_attribute) 1 << 48)
+/*! Needs a virtual mapping for runtime services */
+#define GD_MEMORY_RUNTIME       ((gd_memory_map_attribute) 1 << 63)
+
 /*! A memory map entry. This format is aligned with, but not the same as that
  *  used by the UEFI specification. In particular, UEFI uses a pageCount member;
  *  Gandr uses a size member;
@@ -129,6 +165,34 @@ static inline size_t gd_mmap_get_size(gd_memory_map_table *table)
     return (table->header.length - sizeof (gd_table)) / sizeof (gd_memory_map_entry);
 }
 
+/*! A range of physical memory belonging to one NUMA proximity domain */
+typedef struct {
+    /*! Physical address at which the range begins */
+    uint64_t physical_start;
+
+    /*! Size, in bytes, of the range */
+    uint64_t size;
+
+    /*! Proximity domain, as in the ACPI SRAT or a devicetree numa-node-id */
+    uint32_t proximity_domain;
+
+    uint32_t reserved;
+} gd_memory_node_entry;
+
+/*! System memory affinity, sorted by address. Only present on systems which
+ *  describe it.
+ */
+typedef struct {
+    gd_table header;
+    gd_memory_node_entry entries[];
+} gd_memory_node_table;
+#define GD_MEMORY_NODE_TABLE_ID GD_TABLE_ID('N', 'U', 'M', 'A')
+
+static inline size_t gd_mmap_get_node_count(gd_memory_node_table *table)
+{
+    return (table->header.length - sizeof (gd_table)) / sizeof (gd_memory_node_entry);
+}
+
 /*! ACPI Root System Description Table Pointer.
  *
  *  On ACPI systems, Gandr will retrieve the RSDT Pointer from the system
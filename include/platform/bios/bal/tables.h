@@ -66,6 +66,43 @@ struct smbios_entry_point {
     uint8_t bcd_revision;
 } __attribute__((packed));
 
+/*! Header common to all ACPI system description tables. */
+struct acpi_sdt_header {
+    uint8_t signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t oemid[6];
+    uint8_t oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+/*! System Resource Affinity Table. Followed by affinity structures, each
+ *  starting with a type and length byte. */
+struct acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t table_revision;
+    uint64_t reserved;
+} __attribute__((packed));
+
+#define SRAT_MEMORY_AFFINITY            1
+#define SRAT_MEMORY_ENABLED             (1 << 0)
+
+struct srat_memory_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity_domain;
+    uint16_t reserved0;
+    uint64_t base_address;
+    uint64_t length_bytes;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+#define SRAT_SIGNATURE                  TABLE_SIGNATURE('S', 'R', 'A', 'T')
 #define SMBIOS_ENTRY_POINT_SIGNATURE    TABLE_SIGNATURE('_', 'S', 'M', '_')
 #define MPFP_SIGNATURE                  TABLE_SIGNATURE('_', 'M', 'P', '_')
 